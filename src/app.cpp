@@ -55,13 +55,7 @@ App *App::Get()
 }
 
 App::App()
-    : _settings { 
-        .texturesDir = "assets/textures",
-        .shapesDir = "assets/models/shapes/",
-        .undoMax = 30UL,
-        .mouseSensitivity = 0.5f,
-        .exportSeparateGeometry = false
-    },
+    : _settings      (),
     _mapMan        (std::make_unique<MapMan>()),
     _tilePlaceMode (std::make_unique<PlaceMode>(*_mapMan.get())),
     _texPickMode   (std::make_unique<PickMode>(PickMode::Mode::TEXTURES)),
@@ -170,6 +164,12 @@ void App::Update()
         _editorMode->Update();
     }
 
+    //Report on the background save once it's done
+    if (_pendingSave.valid() && _pendingSave.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    {
+        FinishSaving();
+    }
+
     //Draw
     Assets::RedrawIcons(); //This must be done before BeginDrawing() for some reason.
 
@@ -221,6 +221,8 @@ int main(int argc, char **argv)
 	{
         App::Get()->Update();
 	}
+
+    App::Get()->FinishSaving();
     
 	CloseWindow();
 
@@ -245,6 +247,7 @@ void App::ResetEditorCamera()
 
 void App::NewMap(int width, int height, int length)
 {
+    FinishSaving();
     _mapMan->NewMap(width, height, length);
     _tilePlaceMode->ResetCamera();
     _tilePlaceMode->ResetGrid();
@@ -266,6 +269,8 @@ void App::ShrinkMap()
 
 void App::TryOpenMap(fs::path path)
 {
+    //The file may be the one that is still being saved.
+    FinishSaving();
     fs::directory_entry entry {path};
     if (entry.exists() && entry.is_regular_file())
     {
@@ -313,18 +318,16 @@ void App::TrySaveMap(fs::path path)
 
     if (path.extension() == ".te3") 
     {
-        if (_mapMan->SaveTE3Map(path))
-        {
-            _lastSavedPath = path;
-            std::string msg = "Saved .te3 map '";
-            msg += path.filename().string();
-            msg += "'.";
-            DisplayStatusMessage(msg, 5.0f, 100);
-        }
-        else
-        {
-            DisplayStatusMessage("ERROR: Map could not be saved. Check the console.", 5.0f, 100);
-        }
+        //Saves are finished in the order they're started, so that an older one can't replace the file after a newer one.
+        FinishSaving();
+        _pendingSavePath = path;
+        //This is set now rather than when the save finishes, in case another map is opened in the meantime.
+        _lastSavedPath = path;
+        _pendingSave = _mapMan->SaveTE3MapAsync(path, _settings.saveBinaryMaps);
+        std::string msg = "Saving .te3 map '";
+        msg += path.filename().string();
+        msg += "'...";
+        DisplayStatusMessage(msg, 60.0f, 100);
     }
     else
     {
@@ -332,7 +335,24 @@ void App::TrySaveMap(fs::path path)
     }
 }
 
-void App::TryExportMap(fs::path path, bool separateGeometry)
+void App::FinishSaving()
+{
+    if (!_pendingSave.valid()) return;
+
+    if (_pendingSave.get())
+    {
+        std::string msg = "Saved .te3 map '";
+        msg += _pendingSavePath.filename().string();
+        msg += "'.";
+        DisplayStatusMessage(msg, 5.0f, 100);
+    }
+    else
+    {
+        DisplayStatusMessage("ERROR: Map could not be saved. Check the console.", 5.0f, 100);
+    }
+}
+
+void App::TryExportMap(fs::path path, bool separateGeometry, bool mergeFaces)
 {
     //Add correct extension if no extension is given.
     if (path.extension().empty())
@@ -344,7 +364,7 @@ void App::TryExportMap(fs::path path, bool separateGeometry)
 
     if (path.extension() == ".gltf") 
     {
-        if (_mapMan->ExportGLTFScene(path, separateGeometry))
+        if (_mapMan->ExportGLTFScene(path, separateGeometry, mergeFaces))
         {
             DisplayStatusMessage("Exported .gltf file.", 5.0f, 100);
         }
@@ -26,6 +26,7 @@
 
 #include <string>
 #include <memory>
+#include <future>
 #include <filesystem>
 namespace fs = std::filesystem;
 
@@ -44,14 +45,19 @@ class App
 public:
     struct Settings 
     {
-        std::string texturesDir;
-        std::string shapesDir;
-        size_t undoMax;
-        float mouseSensitivity;
-        bool exportSeparateGeometry; //For GLTF export
+        std::string texturesDir = "assets/textures";
+        std::string shapesDir = "assets/models/shapes/";
+        size_t undoMax = 30UL;
+        float mouseSensitivity = 0.5f;
+        bool exportSeparateGeometry = false; //For GLTF export
         std::string exportFilePath; //For GLTF export
+        bool exportMergeFaces = true; //For GLTF export
+        size_t undoMemoryMax = 256UL; //In megabytes
+        bool undoSpill = false; //Compress undo actions over the memory limit into a temporary file instead of forgetting them
+        bool saveBinaryMaps = false; //Save .te3 files in the binary format instead of JSON
     };
-    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Settings, texturesDir, shapesDir, undoMax, mouseSensitivity, exportSeparateGeometry, exportFilePath);
+    //Keys missing from the settings file keep the defaults above, so that files from older versions still load.
+    NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(Settings, texturesDir, shapesDir, undoMax, mouseSensitivity, exportSeparateGeometry, exportFilePath, exportMergeFaces, undoMemoryMax, undoSpill, saveBinaryMaps);
 
     //Mode implementation
     class ModeImpl 
@@ -73,6 +79,8 @@ public:
 
     inline float       GetMouseSensitivity() { return _settings.mouseSensitivity; }
     inline size_t      GetUndoMax() { return _settings.undoMax; }
+    inline size_t      GetUndoMemoryMax() { return _settings.undoMemoryMax * 1024 * 1024; } //In bytes
+    inline bool        IsUndoSpillEnabled() { return _settings.undoSpill; }
     inline std::string GetTexturesDir() { return _settings.texturesDir; };
     inline std::string GetShapesDir() { return _settings.shapesDir; } 
 
@@ -98,7 +106,9 @@ public:
     void ShrinkMap();
     void TryOpenMap(fs::path path);
     void TrySaveMap(fs::path path);
-    void TryExportMap(fs::path path, bool separateGeometry);
+    //Waits for the map that is being saved in the background, if there is one, and reports whether it was saved.
+    void FinishSaving();
+    void TryExportMap(fs::path path, bool separateGeometry, bool mergeFaces);
 
     //Serializes settings into JSON file and exports.
     void SaveSettings();
@@ -122,6 +132,9 @@ private:
     fs::path _lastSavedPath;
     bool _previewDraw;
 
+    std::future<bool> _pendingSave; //The result of the save running in the background, if there is one
+    fs::path _pendingSavePath;
+
     bool _quit;
 };
 
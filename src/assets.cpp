@@ -83,7 +83,9 @@ Assets::Assets()
     _mapShaderInstanced = LoadShaderFromMemory(MAP_SHADER_INSTANCED_V_SRC, MAP_SHADER_F_SRC);
     _mapShaderInstanced.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(_mapShaderInstanced, "mvp");
     _mapShaderInstanced.locs[SHADER_LOC_VECTOR_VIEW] = GetShaderLocation(_mapShaderInstanced, "viewPos");
-    _mapShaderInstanced.locs[SHADER_LOC_MATRIX_MODEL] = GetShaderLocationAttrib(_mapShaderInstanced, "instanceTransform");
+    _mapShaderInstanced.locs[SHADER_LOC_MATRIX_MODEL] = GetShaderLocationAttrib(_mapShaderInstanced, "instanceData");
+    _mapShaderInstanced.locs[MAP_SHADER_LOC_CHUNK_OFFSET] = GetShaderLocation(_mapShaderInstanced, "chunkOffset");
+    _mapShaderInstanced.locs[MAP_SHADER_LOC_GRID_SPACING] = GetShaderLocation(_mapShaderInstanced, "gridSpacing");
 
     _mapShader = LoadShaderFromMemory(MAP_SHADER_V_SRC, MAP_SHADER_F_SRC);
     _mapShader.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(_mapShader, "mvp");
@@ -103,12 +105,38 @@ TexID Assets::TexIDFromPath(fs::path texturePath)
         if (pair.first == texturePath) return id;
     }
     TexID id = a->_nextTexID;
-    a->_textures[id] = std::pair(texturePath, LoadTexture(texturePath.string().c_str()));
-    if (a->_textures[id].second.width == 0) a->_textures[id] = std::pair(texturePath, a->_missingTexture);
+    Image image = LoadImage(texturePath.string().c_str());
+    if (image.data != NULL)
+    {
+        a->_textures[id] = std::pair(texturePath, LoadTextureFromImage(image));
+
+        //Check for pixels that the map shader will discard
+        Color *pixels = LoadImageColors(image);
+        for (int p = 0; p < image.width * image.height; ++p)
+        {
+            if (pixels[p].a < MAP_SHADER_ALPHA_CUTOFF)
+            {
+                a->_seeThroughTextures.insert(id);
+                break;
+            }
+        }
+        UnloadImageColors(pixels);
+        UnloadImage(image);
+    }
+    if (a->_textures.find(id) == a->_textures.end() || a->_textures[id].second.width == 0) 
+    {
+        a->_textures[id] = std::pair(texturePath, a->_missingTexture);
+    }
     ++a->_nextTexID;
     return id;
 }
 
+bool Assets::IsTextureSeeThrough(TexID texID)
+{
+    Assets *a = _Get();
+    return a->_seeThroughTextures.find(texID) != a->_seeThroughTextures.end();
+}
+
 fs::path Assets::PathFromTexID(TexID texID)
 {
     Assets *a = _Get();
@@ -297,6 +325,7 @@ void Assets::Clear()
         UnloadTexture(pair.second);
     }
     a->_textures.clear();
+    a->_seeThroughTextures.clear();
 
     for (const auto &[id, pair] : a->_models)
     {
@@ -26,6 +26,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <filesystem>
 namespace fs = std::filesystem;
 
@@ -35,6 +36,13 @@ typedef int TexID;
 #define NO_TEX -1
 #define NO_MODEL -1
 
+//Locations of the instanced map shader's uniforms that raylib has no slot for, stored after raylib's own in Shader::locs.
+#define MAP_SHADER_LOC_CHUNK_OFFSET (SHADER_LOC_MAP_BRDF + 1)
+#define MAP_SHADER_LOC_GRID_SPACING (SHADER_LOC_MAP_BRDF + 2)
+
+//Texels with less alpha than this (0.9 in MAP_SHADER_F_SRC) are discarded by the map shader.
+#define MAP_SHADER_ALPHA_CUTOFF 230
+
 //A repository that caches all loaded resources and their file paths, indexing some using integer IDs.
 //It is implemented as a singleton with a static interface.
 class Assets 
@@ -43,6 +51,8 @@ public:
     static TexID TexIDFromPath(fs::path texturePath);
     static fs::path PathFromTexID(TexID texID);
     static const Texture2D &TexFromID(TexID texID);
+    //Returns true if the texture has pixels that the map shader discards, so that things behind it can be seen.
+    static bool IsTextureSeeThrough(TexID texID);
     static const Material &GetMaterialForTexture(TexID texID, bool instanced);
     static TexID FindLoadedMaterialTexID(const Material &material, bool instanced);
     static ModelID ModelIDFromPath(fs::path modelPath);
@@ -66,6 +76,7 @@ public:
     static void Clear();
 protected:
     std::map<TexID, std::pair<fs::path, Texture2D>>  _textures;
+    std::set<TexID>                                  _seeThroughTextures;
     std::map<TexID, Material>                        _materials; //Materials that use the default shader.
     std::map<TexID, Material>                        _instancedMaterials; //Materials that use the instanced shader.
     std::map<ModelID, std::pair<fs::path, Model>>    _models;
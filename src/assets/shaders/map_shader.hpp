@@ -31,31 +31,40 @@ in vec2 vertexTexCoord;
 in vec3 vertexNormal;
 in vec4 vertexColor;
 
-in mat4 instanceTransform;
+// Cel coordinates relative to the chunk (xyz) and orientation index (w) of each tile
+in vec4 instanceData;
 
 // Input uniform values
 uniform mat4 mvp;
+uniform vec3 chunkOffset; // World position of the center of the chunk's first cel
+uniform float gridSpacing;
 
 // Output vertex attributes (to fragment shader)
 out vec2 fragTexCoord;
 out vec4 fragColor;
 out vec3 fragNormal;
 
-// NOTE: Add here your custom variables
+// Sine and cosine of each quarter turn, kept exact so that neighboring tiles line up
+const vec2 QUARTER_TURNS[4] = vec2[4](vec2(0.0, 1.0), vec2(1.0, 0.0), vec2(0.0, -1.0), vec2(-1.0, 0.0));
 
 void main()
 {
-    // Compute MVP for current instance
-    mat4 mvpi = mvp * instanceTransform;
+    // Rotate around the X axis by the pitch, then around the Y axis by the yaw (same as TileRotationMatrix())
+    int orientation = int(instanceData.w);
+    vec2 yaw = QUARTER_TURNS[orientation % 4];
+    vec2 pitch = QUARTER_TURNS[orientation / 4];
+    mat3 rotation = 
+        mat3(yaw.y, 0.0, yaw.x, 0.0, 1.0, 0.0, -yaw.x, 0.0, yaw.y) *
+        mat3(1.0, 0.0, 0.0, 0.0, pitch.y, -pitch.x, 0.0, pitch.x, pitch.y);
 
     // Send vertex attributes to fragment shader
     fragTexCoord = vertexTexCoord;
     fragColor = vertexColor;
-    mat3 matNormal = mat3(instanceTransform[0].xyz, instanceTransform[1].xyz, instanceTransform[2].xyz);
-    fragNormal = normalize(matNormal*vertexNormal);
+    fragNormal = normalize(rotation*vertexNormal);
 
     // Calculate final vertex position
-    gl_Position = mvpi*vec4(vertexPosition, 1.0);
+    vec3 worldPos = chunkOffset + (instanceData.xyz * gridSpacing) + (rotation*vertexPosition);
+    gl_Position = mvp*vec4(worldPos, 1.0);
 }
 
 )SHADER";
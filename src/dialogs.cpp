@@ -449,13 +449,17 @@ SettingsDialog::SettingsDialog(App::Settings &settings)
     : _settings(settings),
       _undoMaxEdit(false),
       _undoMax(settings.undoMax),
+      _undoMemoryMax(settings.undoMemoryMax),
+      _undoMemoryMaxEdit(false),
+      _undoSpill(settings.undoSpill),
+      _saveBinaryMaps(settings.saveBinaryMaps),
       _sensitivity(settings.mouseSensitivity)
 {
 }
 
 bool SettingsDialog::Draw()
 {
-    const Rectangle DRECT = DialogRec(512.0f, 256.0f);
+    const Rectangle DRECT = DialogRec(512.0f, 416.0f);
 
     bool clicked = GuiWindowBox(DRECT, "Settings");
 
@@ -464,7 +468,10 @@ bool SettingsDialog::Draw()
         SETTINGS_RECT,
         {
             (Rectangle) { .x = 16.0f, .width = 128.0f, .height = 32.0f }, //0: Undo max
-            (Rectangle) { .x = 16.0f, .width = SETTINGS_RECT.width - 64.0f, .height = 32.0f }  //1: Sensitivity
+            (Rectangle) { .x = 16.0f, .width = 128.0f, .height = 32.0f }, //1: Undo memory max
+            (Rectangle) { .x = 16.0f, .width = 32.0f, .height = 32.0f }, //2: Undo spill
+            (Rectangle) { .x = 16.0f, .width = 32.0f, .height = 32.0f }, //3: Binary maps
+            (Rectangle) { .x = 16.0f, .width = SETTINGS_RECT.width - 64.0f, .height = 32.0f }  //4: Sensitivity
         }
     );
 
@@ -474,8 +481,18 @@ bool SettingsDialog::Draw()
         _undoMaxEdit = !_undoMaxEdit;
     }
 
-    GuiLabel((Rectangle) { recs[1].x, recs[1].y - 12.0f }, TextFormat("Mouse sensitivity: %.2f", _sensitivity));
-    _sensitivity = GuiSlider(recs[1], "", "", _sensitivity, 0.05f, 10.0f);
+    GuiLabel((Rectangle) { recs[1].x, recs[1].y - 12.0f }, "Max Undo Memory (MB)");
+    if (GuiSpinner(recs[1], "", &_undoMemoryMax, 1, 4096, _undoMemoryMaxEdit))
+    {
+        _undoMemoryMaxEdit = !_undoMemoryMaxEdit;
+    }
+
+    _undoSpill = GuiCheckBox(recs[2], "Move old undo history to disk instead of forgetting it", _undoSpill);
+
+    _saveBinaryMaps = GuiCheckBox(recs[3], "Save maps in the binary format (smaller and faster to load)", _saveBinaryMaps);
+
+    GuiLabel((Rectangle) { recs[4].x, recs[4].y - 12.0f }, TextFormat("Mouse sensitivity: %.2f", _sensitivity));
+    _sensitivity = GuiSlider(recs[4], "", "", _sensitivity, 0.05f, 10.0f);
     _sensitivity = floorf(_sensitivity / 0.05f) * 0.05f;
 
     //Confirm buttons
@@ -488,6 +505,9 @@ bool SettingsDialog::Draw()
     if (GuiButton(buttRecs[0], "Confirm"))
     {
         _settings.undoMax = _undoMax;
+        _settings.undoMemoryMax = _undoMemoryMax;
+        _settings.undoSpill = _undoSpill;
+        _settings.saveBinaryMaps = _saveBinaryMaps;
         _settings.mouseSensitivity = _sensitivity;
         App::Get()->SaveSettings();
         return false;
@@ -605,7 +625,7 @@ ExportDialog::ExportDialog(App::Settings &settings)
 
 bool ExportDialog::Draw()
 {
-    const Rectangle DRECT = DialogRec(512.0f, 256.0f);
+    const Rectangle DRECT = DialogRec(512.0f, 288.0f);
 
     if (_dialog.get())
     {
@@ -634,10 +654,13 @@ bool ExportDialog::Draw()
     const Rectangle SEP_BUTT_RECT = (Rectangle) { BROWSE_BUTT_RECT.x, BROWSE_BUTT_RECT.y + BROWSE_BUTT_RECT.height + 32.0f, 32.0f, 32.0f };
     _settings.exportSeparateGeometry = GuiCheckBox(SEP_BUTT_RECT, "Seperate nodes for each texture", _settings.exportSeparateGeometry);
 
+    const Rectangle MERGE_BUTT_RECT = (Rectangle) { SEP_BUTT_RECT.x, SEP_BUTT_RECT.y + SEP_BUTT_RECT.height + 8.0f, 32.0f, 32.0f };
+    _settings.exportMergeFaces = GuiCheckBox(MERGE_BUTT_RECT, "Merge flat faces into larger ones", _settings.exportMergeFaces);
+
     const Rectangle EXPORT_BUTT_RECT = (Rectangle) { DRECT.x + DRECT.width / 2.0f - 64.0f, DRECT.y + DRECT.height - 40.0f, 128.0f, 32.0f };
     if (GuiButton(EXPORT_BUTT_RECT, "Export"))
     {
-        App::Get()->TryExportMap(fs::path(_settings.exportFilePath), _settings.exportSeparateGeometry);
+        App::Get()->TryExportMap(fs::path(_settings.exportFilePath), _settings.exportSeparateGeometry, _settings.exportMergeFaces);
         App::Get()->SaveSettings();
         return false;
     }
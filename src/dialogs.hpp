@@ -135,6 +135,10 @@ protected:
     App::Settings &_settings;
     int _undoMax;
     bool _undoMaxEdit;
+    int _undoMemoryMax;
+    bool _undoMemoryMaxEdit;
+    bool _undoSpill;
+    bool _saveBinaryMaps;
     float _sensitivity;
 };
 
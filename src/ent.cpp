@@ -33,60 +33,43 @@
 
 void EntGrid::Draw(Camera &camera, int fromY, int toY)
 {
-    for (size_t i = 0; i < _grid.size(); ++i)
-    {
-        if (_grid[i])
+    ForEachOccupied(0, fromY, 0, _width, toY - fromY + 1, _length, [&](int x, int y, int z, const Ent &ent) {
+        //Do frustrum culling check
+        Vector3 ndc = GetWorldToNDC(ent.position, camera);
+        if (ndc.z < 1.0f && ndc.x > -1.0f && ndc.x < 1.0f && ndc.y > -1.0f && ndc.y < 1.0f)
         {
-            Vector3 gridCoords = UnflattenIndex(i);
-            if (gridCoords.y >= (float)fromY - 0.1f && gridCoords.y <= toY + 0.1f) 
-            {
-                _grid[i].position = GridToWorldPos(gridCoords, true);
-                //Do frustrum culling check
-                Vector3 ndc = GetWorldToNDC(_grid[i].position, camera);
-                if (ndc.z < 1.0f && ndc.x > -1.0f && ndc.x < 1.0f && ndc.y > -1.0f && ndc.y < 1.0f)
-                {
-                    _grid[i].Draw();
-                }
-            }
+            ent.Draw();
         }
-    }
+    });
 }
 
 void EntGrid::DrawLabels(Camera &camera, int fromY, int toY)
 {
     if (!App::Get()->IsPreviewing())
     {
-        for (size_t i = 0; i < _grid.size(); ++i)
-        {
-            if (_grid[i])
+        ForEachOccupied(0, fromY, 0, _width, toY - fromY + 1, _length, [&](int x, int y, int z, const Ent &ent) {
+            if (ent.properties.find("name") != ent.properties.end()) 
             {
-                Vector3 gridCoords = UnflattenIndex(i);
-                if (gridCoords.y >= (float)fromY - 0.1f && gridCoords.y <= toY + 0.1f) 
+                //Do frustrum culling check
+                Vector3 ndc = GetWorldToNDC(GridToWorldPos((Vector3) { (float)x, (float)y, (float)z }, true), camera);
+                if (ndc.z < 0.9995f)
                 {
-                    if (_grid[i].properties.find("name") != _grid[i].properties.end()) 
-                    {
-                        //Do frustrum culling check
-                        Vector3 ndc = GetWorldToNDC(_grid[i].position, camera);
-                        if (ndc.z < 0.9995f)
-                        {
-                            // std::cout << ndc.z << std::endl;
-                            //Draw label
-                            std::string name = _grid[i].properties.at("name");
+                    // std::cout << ndc.z << std::endl;
+                    //Draw label
+                    std::string name = ent.properties.at("name");
 
-                            float fontSize = Assets::GetFont().baseSize;
-                            Vector2 projectPos = (Vector2){ (float)GetScreenWidth() * (ndc.x + 1.0f) / 2.0f, (float)GetScreenHeight() * (ndc.y + 1.0f) / 2.0f };
-                            int stringWidth = GetStringWidth(Assets::GetFont(), fontSize, name);
+                    float fontSize = Assets::GetFont().baseSize;
+                    Vector2 projectPos = (Vector2){ (float)GetScreenWidth() * (ndc.x + 1.0f) / 2.0f, (float)GetScreenHeight() * (ndc.y + 1.0f) / 2.0f };
+                    int stringWidth = GetStringWidth(Assets::GetFont(), fontSize, name);
 
-                            float labelX = projectPos.x - (float)stringWidth / 2.0f;
-                            float labelY = projectPos.y - fontSize / 2.0f;
+                    float labelX = projectPos.x - (float)stringWidth / 2.0f;
+                    float labelY = projectPos.y - fontSize / 2.0f;
 
-                            DrawRectangle((int)labelX, (int)labelY, (float)stringWidth, fontSize, BLACK);
-                            DrawTextEx(Assets::GetFont(), name.c_str(), (Vector2) { labelX, labelY }, fontSize, 0.0f, WHITE);
-                        }
-                    }
+                    DrawRectangle((int)labelX, (int)labelY, (float)stringWidth, fontSize, BLACK);
+                    DrawTextEx(Assets::GetFont(), name.c_str(), (Vector2) { labelX, labelY }, fontSize, 0.0f, WHITE);
                 }
             }
-        }
+        });
     }
 }
 
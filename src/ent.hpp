@@ -124,14 +124,27 @@ public:
         return newGrid;
     }
 
+    //Resizes the grid like Grid::Resize(), and updates the positions of the entities that were moved to match their new cels.
+    inline void Resize(int ofsX, int ofsY, int ofsZ, size_t width, size_t height, size_t length)
+    {
+        Grid<Ent>::Resize(ofsX, ofsY, ofsZ, width, height, length);
+        if (ofsX == 0 && ofsY == 0 && ofsZ == 0) return;
+
+        std::vector<std::tuple<int, int, int>> movedCels;
+        ForEachOccupied([&](int x, int y, int z, const Ent &) { movedCels.push_back({ x, y, z }); });
+        for (const auto &[x, y, z] : movedCels)
+        {
+            Ent ent = GetCel(x, y, z);
+            ent.position = GridToWorldPos((Vector3) { (float)x, (float)y, (float)z }, true);
+            SetCel(x, y, z, ent);
+        }
+    }
+
     //Returns a continuous array of all active entities.
     inline std::vector<Ent> GetEntList() const
     {
         std::vector<Ent> out;
-        for (const Ent &ent : _grid)
-        {
-            if (ent) out.push_back(ent);
-        }
+        ForEachOccupied([&](int, int, int, const Ent &ent) { out.push_back(ent); });
         return out;
     }
 
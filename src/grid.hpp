@@ -23,11 +23,25 @@
 
 #include <stdlib.h>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <tuple>
 #include <assert.h>
 
 #include "math_stuff.hpp"
 
+//The number of cels along each side of a grid chunk.
+#define GRID_CHUNK_SIZE 16
+
 //Represents a 3 dimensional array of tiles and provides functions for converting coordinates.
+//The cels are stored in cubic chunks, which are only allocated once a non-empty cel is written into them.
+//Chunks that are left unallocated read as the grid's fill value, so large and mostly empty grids take up little memory.
+//Each chunk also keeps a bitmap of its non-empty cels so that they can be visited without looking at the empty ones.
+//Copies of a grid share their chunks until one of them writes to a chunk, at which point it makes its own copy.
+//The grid's first cel doesn't have to be at the corner of the first chunk. This lets the grid be resized and shifted by moving whole chunks
+//instead of cels, since the unused space in the chunks along the edges acts as reserved room for the grid to grow into.
+//A cel type is considered empty when it evaluates to false.
 template<class Cel>
 class Grid
 {
@@ -36,9 +50,13 @@ public:
     inline Grid(size_t width, size_t height, size_t length, float spacing, const Cel &fill)
     {
         _width = width; _height = height; _length = length; _spacing = spacing;
-        _grid.resize(width * height * length);
-
-        for (size_t i = 0; i < _grid.size(); ++i) { _grid[i] = fill; }
+        _fill = fill;
+        _originX = _originY = _originZ = 0;
+        _chunksX = (width + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+        _chunksY = (height + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+        _chunksZ = (length + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+        _chunks.resize(_chunksX * _chunksY * _chunksZ);
+        _layerCounts.resize(height, fill ? width * length : 0);
     }
 
     //Constructs a grid full of default-constructed cels.
@@ -118,55 +136,418 @@ public:
         return (Vector3) { (float)_width * _spacing / 2.0f, (float)_height * _spacing / 2.0f, (float)_length * _spacing / 2.0f };
     }
 
+    //Returns the approximate number of bytes taken up by the grid's cels.
+    //Chunks that are shared with other grids are counted in full.
+    inline size_t GetMemoryUsage() const
+    {
+        size_t bytes = (_chunks.capacity() * sizeof(std::shared_ptr<Chunk>)) + (_layerCounts.capacity() * sizeof(size_t));
+        for (const auto &chunk : _chunks)
+        {
+            if (chunk) bytes += sizeof(Chunk);
+        }
+        return bytes;
+    }
+
+    //Returns the number of non-empty cels on the given layer.
+    inline size_t GetLayerCount(int j) const
+    {
+        return _layerCounts[j];
+    }
+
+    //Calls `fn(x, y, z, cel)` for every non-empty cel inside of the rectangular prism with a corner at (i, j, k) and size (w, h, l).
+    //Unallocated chunks, empty layers, and runs of 64 empty cels are skipped over, so sparse grids are visited quickly.
+    //Cels are visited in chunk order rather than in order of their flat index. `fn` must not modify the grid.
+    template<typename F>
+    inline void ForEachOccupied(int i, int j, int k, int w, int h, int l, F fn) const
+    {
+        //Keep the box inside of the grid
+        int xEnd = Min(i + w, _width), yEnd = Min(j + h, _height), zEnd = Min(k + l, _length);
+        i = Max(i, 0); j = Max(j, 0); k = Max(k, 0);
+        if (i >= xEnd || j >= yEnd || k >= zEnd) return;
+
+        //Walk through the chunks using coordinates relative to the first chunk's corner.
+        i += _originX; xEnd += _originX;
+        j += _originY; yEnd += _originY;
+        k += _originZ; zEnd += _originZ;
+
+        for (int cy = j / GRID_CHUNK_SIZE; cy <= (yEnd - 1) / GRID_CHUNK_SIZE; ++cy)
+        {
+            const int y0 = Max(j, cy * GRID_CHUNK_SIZE), y1 = Min(yEnd, (cy + 1) * GRID_CHUNK_SIZE);
+            bool layersEmpty = true;
+            for (int y = y0; y < y1 && layersEmpty; ++y) layersEmpty = (_layerCounts[y - _originY] == 0);
+            if (layersEmpty) continue;
+
+            for (int cz = k / GRID_CHUNK_SIZE; cz <= (zEnd - 1) / GRID_CHUNK_SIZE; ++cz)
+            {
+                const int z0 = Max(k, cz * GRID_CHUNK_SIZE), z1 = Min(zEnd, (cz + 1) * GRID_CHUNK_SIZE);
+                for (int cx = i / GRID_CHUNK_SIZE; cx <= (xEnd - 1) / GRID_CHUNK_SIZE; ++cx)
+                {
+                    const int x0 = Max(i, cx * GRID_CHUNK_SIZE), x1 = Min(xEnd, (cx + 1) * GRID_CHUNK_SIZE);
+                    const std::shared_ptr<Chunk> &chunk = _chunks[cx + (cz * _chunksX) + (cy * _chunksX * _chunksZ)];
+                    if (!chunk)
+                    {
+                        //An unallocated chunk is entirely made of the fill value.
+                        if (!_fill) continue;
+                        for (int y = y0; y < y1; ++y)
+                            for (int z = z0; z < z1; ++z)
+                                for (int x = x0; x < x1; ++x)
+                                    fn(x - _originX, y - _originY, z - _originZ, _fill);
+                        continue;
+                    }
+                    if (chunk->count == 0) continue;
+
+                    //Mask out the cels on each word's rows that are outside of the box.
+                    const uint64_t rowMask = ((1ULL << (x1 - x0)) - 1ULL) << (x0 % GRID_CHUNK_SIZE);
+                    for (int y = y0; y < y1; ++y)
+                    {
+                        if (_layerCounts[y - _originY] == 0) continue;
+                        const int ly = y % GRID_CHUNK_SIZE;
+                        for (int wz = (z0 % GRID_CHUNK_SIZE) / ROWS_PER_WORD; wz <= ((z1 - 1) % GRID_CHUNK_SIZE) / ROWS_PER_WORD; ++wz)
+                        {
+                            const size_t word = (ly * GRID_CHUNK_SIZE / ROWS_PER_WORD) + wz;
+                            uint64_t bits = chunk->occupied[word];
+                            if (bits == 0ULL) continue;
+
+                            uint64_t mask = 0ULL;
+                            for (int r = 0; r < ROWS_PER_WORD; ++r)
+                            {
+                                int z = (cz * GRID_CHUNK_SIZE) + (wz * ROWS_PER_WORD) + r;
+                                if (z >= z0 && z < z1) mask |= rowMask << (r * GRID_CHUNK_SIZE);
+                            }
+                            bits &= mask;
+
+                            while (bits)
+                            {
+                                const int b = __builtin_ctzll(bits);
+                                bits &= bits - 1ULL;
+                                const size_t celIdx = (word * 64) + b;
+                                fn((cx * GRID_CHUNK_SIZE) + (b % GRID_CHUNK_SIZE) - _originX, 
+                                   y - _originY, 
+                                   (cz * GRID_CHUNK_SIZE) + (wz * ROWS_PER_WORD) + (b / GRID_CHUNK_SIZE) - _originZ, 
+                                   chunk->cels[celIdx]);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    //Calls `fn(x, y, z, cel)` for every non-empty cel in the grid.
+    template<typename F>
+    inline void ForEachOccupied(F fn) const
+    {
+        ForEachOccupied(0, 0, 0, _width, _height, _length, fn);
+    }
+
+    //Calls `fn(i, j, k, w, h, l)` for each box of cels that would be cut off by calling Resize() with the same arguments.
+    //The boxes don't overlap, and boxes with nothing in them are skipped.
+    template<typename F>
+    inline void ForEachCutBox(int ofsX, int ofsY, int ofsZ, size_t width, size_t height, size_t length, F fn) const
+    {
+        //The range of cels that are kept along each axis
+        const int x0 = Min(Max(-ofsX, 0), _width), x1 = Max(Min((int)width - ofsX, _width), x0);
+        const int y0 = Min(Max(-ofsY, 0), _height), y1 = Max(Min((int)height - ofsY, _height), y0);
+        const int z0 = Min(Max(-ofsZ, 0), _length), z1 = Max(Min((int)length - ofsZ, _length), z0);
+
+        auto cut = [&](int i, int j, int k, int w, int h, int l) {
+            if (w > 0 && h > 0 && l > 0) fn(i, j, k, w, h, l);
+        };
+        cut(0,  0, 0, x0,           _height, _length);
+        cut(x1, 0, 0, _width - x1,  _height, _length);
+        cut(x0, 0,  0, x1 - x0, y0,            _length);
+        cut(x0, y1, 0, x1 - x0, _height - y1,  _length);
+        cut(x0, y0, 0,  x1 - x0, y1 - y0, z0);
+        cut(x0, y0, z1, x1 - x0, y1 - y0, _length - z1);
+    }
+
+    //Changes the size of the grid to (width, height, length), moving each cel by (ofsX, ofsY, ofsZ) and erasing the ones that end up outside of it.
+    //Only the chunks are moved, so this takes time depending on the number of chunks and erased cels rather than the total number of cels.
+    //The grid's fill value must be empty, since the space that is added isn't written to.
+    inline void Resize(int ofsX, int ofsY, int ofsZ, size_t width, size_t height, size_t length)
+    {
+        assert(!_fill);
+
+        //Erase the cels that are cut off, which also releases the chunks that won't be inside of the grid anymore.
+        std::vector<std::tuple<int, int, int>> cutCels;
+        ForEachCutBox(ofsX, ofsY, ofsZ, width, height, length, [&](int i, int j, int k, int w, int h, int l) {
+            ForEachOccupied(i, j, k, w, h, l, [&](int x, int y, int z, const Cel &) { cutCels.push_back({ x, y, z }); });
+        });
+        for (const auto &[x, y, z] : cutCels) SetCel(x, y, z, _fill);
+
+        //Choose new origins that keep every cel at the same place inside of its chunk, so that the chunks are moved by whole amounts.
+        auto wrap = [](int n) { return ((n % GRID_CHUNK_SIZE) + GRID_CHUNK_SIZE) % GRID_CHUNK_SIZE; };
+        const int originX = wrap(_originX - ofsX), originY = wrap(_originY - ofsY), originZ = wrap(_originZ - ofsZ);
+        const int shiftX = (ofsX + originX - _originX) / GRID_CHUNK_SIZE;
+        const int shiftY = (ofsY + originY - _originY) / GRID_CHUNK_SIZE;
+        const int shiftZ = (ofsZ + originZ - _originZ) / GRID_CHUNK_SIZE;
+        const int chunksX = (originX + width + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+        const int chunksY = (originY + height + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+        const int chunksZ = (originZ + length + GRID_CHUNK_SIZE - 1) / GRID_CHUNK_SIZE;
+
+        std::vector<std::shared_ptr<Chunk>> chunks(chunksX * chunksY * chunksZ);
+        for (size_t c = 0; c < _chunks.size(); ++c)
+        {
+            if (!_chunks[c]) continue;
+            const int cx = (c % _chunksX) + shiftX, cy = (c / (_chunksX * _chunksZ)) + shiftY, cz = ((c / _chunksX) % _chunksZ) + shiftZ;
+            assert(cx >= 0 && cy >= 0 && cz >= 0 && cx < chunksX && cy < chunksY && cz < chunksZ);
+            chunks[cx + (cz * chunksX) + (cy * chunksX * chunksZ)] = std::move(_chunks[c]);
+        }
+
+        std::vector<size_t> layerCounts(height, 0);
+        for (int y = Max(-ofsY, 0); y < Min((int)height - ofsY, _height); ++y) layerCounts[y + ofsY] = _layerCounts[y];
+
+        _chunks = std::move(chunks);
+        _layerCounts = std::move(layerCounts);
+        _chunksX = chunksX; _chunksY = chunksY; _chunksZ = chunksZ;
+        _originX = originX; _originY = originY; _originZ = originZ;
+        _width = width; _height = height; _length = length;
+    }
+
 protected:
+    static constexpr size_t CHUNK_VOLUME = GRID_CHUNK_SIZE * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE;
+    static constexpr int ROWS_PER_WORD = 64 / GRID_CHUNK_SIZE; //Number of X axis rows covered by each word of a chunk's bitmap
+
+    struct Chunk
+    {
+        Cel cels[CHUNK_VOLUME]; //Ordered by X, then Z, then Y like the grid's flat indices.
+        uint64_t occupied[CHUNK_VOLUME / 64]; //One bit for each cel, set if it is non-empty.
+        size_t count; //Number of non-empty cels
+    };
+
+    inline size_t _ChunkIndex(int i, int j, int k) const
+    {
+        i += _originX; j += _originY; k += _originZ;
+        return (i / GRID_CHUNK_SIZE) + ((k / GRID_CHUNK_SIZE) * _chunksX) + ((j / GRID_CHUNK_SIZE) * _chunksX * _chunksZ);
+    }
+
+    inline size_t _IndexInChunk(int i, int j, int k) const
+    {
+        i += _originX; j += _originY; k += _originZ;
+        return (i % GRID_CHUNK_SIZE) + ((k % GRID_CHUNK_SIZE) * GRID_CHUNK_SIZE) + ((j % GRID_CHUNK_SIZE) * GRID_CHUNK_SIZE * GRID_CHUNK_SIZE);
+    }
+
+    //Gives the coordinates of the cel at the corner of the chunk with the given index.
+    //They are negative for the first chunks along each axis if the grid doesn't start at their corners.
+    inline void _ChunkCorner(size_t chunkIdx, int &i, int &j, int &k) const
+    {
+        i = ((chunkIdx % _chunksX) * GRID_CHUNK_SIZE) - _originX;
+        j = ((chunkIdx / (_chunksX * _chunksZ)) * GRID_CHUNK_SIZE) - _originY;
+        k = (((chunkIdx / _chunksX) % _chunksZ) * GRID_CHUNK_SIZE) - _originZ;
+    }
+
+    //Returns the chunk at the given index so that it can be modified, allocating it or detaching it from other grids if necessary.
+    inline Chunk &_MutableChunk(size_t chunkIdx)
+    {
+        std::shared_ptr<Chunk> &chunk = _chunks[chunkIdx];
+        if (!chunk)
+        {
+            chunk = std::make_shared<Chunk>();
+            for (size_t c = 0; c < CHUNK_VOLUME; ++c) chunk->cels[c] = _fill;
+            for (size_t w = 0; w < CHUNK_VOLUME / 64; ++w) chunk->occupied[w] = _fill ? ~0ULL : 0ULL;
+            chunk->count = _fill ? CHUNK_VOLUME : 0;
+        }
+        else if (chunk.use_count() > 1)
+        {
+            chunk = std::make_shared<Chunk>(*chunk);
+        }
+        return *chunk;
+    }
+
+    //Assigns a cel inside of the given chunk, allocating the chunk only if needed and releasing it once it no longer holds anything.
+    inline void _AssignInChunk(size_t chunkIdx, size_t celIdx, const Cel &cel)
+    {
+        bool isFull = cel;
+        if (!_chunks[chunkIdx] && !isFull && !_fill) return; //Empty cels do not need to be stored in empty chunks.
+
+        Chunk &chunk = _MutableChunk(chunkIdx);
+        bool wasFull = chunk.cels[celIdx];
+        chunk.cels[celIdx] = cel;
+        if (wasFull != isFull)
+        {
+            const size_t layer = ((chunkIdx / (_chunksX * _chunksZ)) * GRID_CHUNK_SIZE) + (celIdx / (GRID_CHUNK_SIZE * GRID_CHUNK_SIZE)) - _originY;
+            const uint64_t bit = 1ULL << (celIdx % 64);
+            if (isFull)
+            {
+                chunk.occupied[celIdx / 64] |= bit;
+                ++chunk.count;
+                ++_layerCounts[layer];
+            }
+            else
+            {
+                chunk.occupied[celIdx / 64] &= ~bit;
+                --chunk.count;
+                --_layerCounts[layer];
+            }
+        }
+        if (chunk.count == 0 && !_fill) _chunks[chunkIdx].reset();
+    }
+
+    //Copies `n` cels along the X axis from `src`, starting at (si, sj, sk), into this grid starting at (i, j, k).
+    //If `ignoreEmpty` is true, then empty cels in `src` do not overwrite existing cels.
+    //Each copied cel is passed through `remap` before being stored.
+    template<typename Remap>
+    inline void _CopyRow(int i, int j, int k, const Grid<Cel> &src, int si, int sj, int sk, int n, bool ignoreEmpty, Remap &remap)
+    {
+        int x = 0;
+        while (x < n)
+        {
+            //Copy in segments that do not cross the boundaries of either grid's chunks.
+            int ourLeft = GRID_CHUNK_SIZE - ((i + x + _originX) % GRID_CHUNK_SIZE);
+            int theirLeft = GRID_CHUNK_SIZE - ((si + x + src._originX) % GRID_CHUNK_SIZE);
+            int segment = Min(n - x, Min(ourLeft, theirLeft));
+
+            size_t ourChunk = _ChunkIndex(i + x, j, k);
+            const std::shared_ptr<Chunk> &theirChunk = src._chunks[src._ChunkIndex(si + x, sj, sk)];
+            if (theirChunk)
+            {
+                const Cel *theirCels = &theirChunk->cels[src._IndexInChunk(si + x, sj, sk)];
+                for (int c = 0; c < segment; ++c)
+                {
+                    if (!ignoreEmpty || theirCels[c])
+                    {
+                        _AssignInChunk(ourChunk, _IndexInChunk(i + x + c, j, k), remap(theirCels[c]));
+                    }
+                }
+            }
+            else if (!ignoreEmpty || src._fill)
+            {
+                //Unallocated source chunks are entirely made of the fill value.
+                const Cel fill = remap(src._fill);
+                for (int c = 0; c < segment; ++c)
+                {
+                    _AssignInChunk(ourChunk, _IndexInChunk(i + x + c, j, k), fill);
+                }
+            }
+
+            x += segment;
+        }
+    }
+
     inline void SetCel(int i, int j, int k, const Cel& cel) 
     {
-        _grid[FlatIndex(i, j, k)] = cel;
+        _AssignInChunk(_ChunkIndex(i, j, k), _IndexInChunk(i, j, k), cel);
     }
 
-    inline Cel GetCel(int i, int j, int k) const 
+    inline const Cel &GetCel(int i, int j, int k) const 
     {
-        return _grid[FlatIndex(i, j, k)];
+        const std::shared_ptr<Chunk> &chunk = _chunks[_ChunkIndex(i, j, k)];
+        if (!chunk) return _fill;
+        return chunk->cels[_IndexInChunk(i, j, k)];
     }
 
-    inline void CopyCels(int i, int j, int k, const Grid<Cel> &src)
+    //Sets all cels inside of the rectangular prism with a corner at (i, j, k) and size (w, h, l).
+    inline void FillCels(int i, int j, int k, int w, int h, int l, const Cel &cel)
+    {
+        assert(i >= 0 && j >= 0 && k >= 0);
+        assert(i + w <= (int)_width && j + h <= (int)_height && k + l <= (int)_length);
+        for (int y = j; y < j + h; ++y)
+        {
+            for (int z = k; z < k + l; ++z)
+            {
+                for (int x = i; x < i + w; ++x)
+                {
+                    SetCel(x, y, z, cel);
+                }
+            }
+        }
+    }
+
+    //Copies the `_width` cels of the row at layer `j` and depth `k` into `out`.
+    inline void GetCelRow(int j, int k, Cel *out) const
+    {
+        for (int x = 0; x < (int)_width;)
+        {
+            //Copy the parts of the row inside of each chunk all at once.
+            const int segment = Min(_width - x, GRID_CHUNK_SIZE - ((x + _originX) % GRID_CHUNK_SIZE));
+            const std::shared_ptr<Chunk> &chunk = _chunks[_ChunkIndex(x, j, k)];
+            if (chunk) std::copy_n(&chunk->cels[_IndexInChunk(x, j, k)], segment, out + x);
+            else std::fill_n(out + x, segment, _fill);
+            x += segment;
+        }
+    }
+
+    //Copies every cel into `out` in the order of their flat indices. `out` must have room for all of them.
+    inline void GetCelsFlat(Cel *out) const
+    {
+        for (int y = 0; y < (int)_height; ++y)
+        {
+            for (int z = 0; z < (int)_length; ++z)
+            {
+                GetCelRow(y, z, out + FlatIndex(0, y, z));
+            }
+        }
+    }
+
+    //Assigns the `_width` cels of the row at layer `j` and depth `k` from `in`.
+    inline void SetCelRow(int j, int k, const Cel *in)
+    {
+        for (int x = 0; x < (int)_width;)
+        {
+            const int segment = Min(_width - x, GRID_CHUNK_SIZE - ((x + _originX) % GRID_CHUNK_SIZE));
+            const size_t chunkIdx = _ChunkIndex(x, j, k), celIdx = _IndexInChunk(x, j, k);
+            for (int c = 0; c < segment; ++c) _AssignInChunk(chunkIdx, celIdx + c, in[x + c]);
+            x += segment;
+        }
+    }
+
+    //Assigns every cel from `in`, which holds them in the order of their flat indices.
+    inline void SetCelsFlat(const Cel *in)
+    {
+        for (int y = 0; y < (int)_height; ++y)
+        {
+            for (int z = 0; z < (int)_length; ++z)
+            {
+                SetCelRow(y, z, in + FlatIndex(0, y, z));
+            }
+        }
+    }
+
+    //Takes the cels of `src` and places them in this grid starting at the offset at (i, j, k)
+    //If the offset results in `src` exceeding the current grid's boundaries, it is cut off.
+    //If `ignoreEmpty` is true, then empty cels do not overwrite existing cels.
+    inline void CopyCels(int i, int j, int k, const Grid<Cel> &src, bool ignoreEmpty = false)
+    {
+        auto identity = [](const Cel &cel) -> const Cel & { return cel; };
+        CopyCels(i, j, k, src, ignoreEmpty, identity);
+    }
+
+    //Same as above, but each cel of `src` is converted by the `remap` function before being placed in this grid.
+    template<typename Remap>
+    inline void CopyCels(int i, int j, int k, const Grid<Cel> &src, bool ignoreEmpty, Remap &remap)
     {
         assert(i >= 0 && j >= 0 && k >= 0);
         int xEnd = Min(i + src._width, _width); 
         int yEnd = Min(j + src._height, _height);
         int zEnd = Min(k + src._length, _length);
+        if (xEnd <= i) return;
         for (int z = k; z < zEnd; ++z) 
         {
             for (int y = j; y < yEnd; ++y)
             {
-                size_t ourBase = FlatIndex(0, y, z);
-                size_t theirBase = src.FlatIndex(0, y - j, z - k);
-                for (int x = i; x < xEnd; ++x)
-                {
-                    const Cel &cel = src._grid[theirBase + (x - i)];
-                    _grid[ourBase + x] = cel;
-                }
+                _CopyRow(i, y, z, src, 0, y - j, z - k, xEnd - i, ignoreEmpty, remap);
             }
         }
     }
 
     inline void SubsectionCopy(int i, int j, int k, int w, int h, int l, Grid<Cel> &out) const
     {
+        if (w <= 0) return;
+        auto identity = [](const Cel &cel) -> const Cel & { return cel; };
         for (int z = k; z < k + l; ++z) 
         {
             for (int y = j; y < j + h; ++y)
             {
-                size_t ourBase = FlatIndex(0, y, z);
-                size_t theirBase = out.FlatIndex(0, y - j, z - k);
-                for (int x = i; x < i + w; ++x)
-                {
-                    out._grid[theirBase + (x - i)] = _grid[ourBase + x];
-                }
+                out._CopyRow(0, y - j, z - k, *this, i, y, z, w, false, identity);
             }
         }
     }
 
-    std::vector<Cel> _grid;
+    std::vector<std::shared_ptr<Chunk>> _chunks;
+    size_t _chunksX, _chunksY, _chunksZ;
+    int _originX, _originY, _originZ; //Position of the grid's first cel inside of the first chunk
+    std::vector<size_t> _layerCounts; //Number of non-empty cels on each layer
+    Cel _fill;
     size_t _width, _height, _length;
     float _spacing;
 };
@@ -26,45 +26,244 @@
 
 #include <fstream>
 #include <iostream>
+#include <cstring>
+#include <set>
+
+#ifdef LINUX_64
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "app.hpp"
 #include "assets.hpp"
 
+//The spill file is compacted once it is at least this big and more than half of it belongs to forgotten actions.
+#define UNDO_SPILL_COMPACT_MIN (16UL * 1024UL * 1024UL)
+
 void MapMan::_Execute(std::shared_ptr<Action> action)
+{
+    EndTileStroke(); //Keep the history in the order that things were done in
+    _AddToHistory(action);
+    action->Do(*this);
+}
+
+void MapMan::_AddToHistory(std::shared_ptr<Action> action)
 {
     _undoHistory.push_back(action);
-    if (_undoHistory.size() > App::Get()->GetUndoMax()) _undoHistory.pop_front();
+    _undoHistoryBytes += action->GetByteSize();
+    for (const std::shared_ptr<Action> &a : _redoHistory) _spilledBytes -= a->GetSpilledByteSize();
     _redoHistory.clear();
-    _undoHistory.back()->Do(*this);
+
+    //Forget the oldest actions once there are too many of them or they take up too much memory, but always keep the newest one.
+    if (App::Get()->IsUndoSpillEnabled())
+    {
+        //Move the oldest actions to disk before resorting to forgetting them.
+        for (size_t a = 0; a + 1 < _undoHistory.size() && _undoHistoryBytes > App::Get()->GetUndoMemoryMax(); ++a)
+        {
+            if (!_spillFile) _spillFile = std::tmpfile();
+            const size_t prevBytes = _undoHistory[a]->GetByteSize(), prevSpilled = _undoHistory[a]->GetSpilledByteSize();
+            if (_undoHistory[a]->Spill(_spillFile)) 
+            {
+                _undoHistoryBytes = _undoHistoryBytes - prevBytes + _undoHistory[a]->GetByteSize();
+                const size_t newSpilled = _undoHistory[a]->GetSpilledByteSize() - prevSpilled;
+                _spilledBytes += newSpilled;
+                _spillFileBytes += newSpilled;
+            }
+        }
+    }
+    while (_undoHistory.size() > 1 && (_undoHistory.size() > App::Get()->GetUndoMax() || _undoHistoryBytes > App::Get()->GetUndoMemoryMax()))
+    {
+        _undoHistoryBytes -= _undoHistory.front()->GetByteSize();
+        _spilledBytes -= _undoHistory.front()->GetSpilledByteSize();
+        _undoHistory.pop_front();
+    }
+
+    //Spilled data is only ever appended, so the space of forgotten actions has to be reclaimed by rewriting the file.
+    if (_spillFile && _spillFileBytes >= UNDO_SPILL_COMPACT_MIN && _spilledBytes < _spillFileBytes / 2) _CompactSpillFile();
 }
 
-void MapMan::ExecuteTileAction(size_t i, size_t j, size_t k, size_t w, size_t h, size_t l, Tile newTile)
+void MapMan::_CompactSpillFile()
+{
+    FILE *newFile = std::tmpfile();
+    if (!newFile)
+    {
+        std::cerr << "Error creating temporary file for undo history." << std::endl;
+        return;
+    }
+
+    //Actions whose data can't be moved have it read back into memory, which changes their size.
+    _spilledBytes = 0;
+    for (const std::shared_ptr<Action> &a : _undoHistory)
+    {
+        const size_t prevBytes = a->GetByteSize();
+        a->MoveSpilled(_spillFile, newFile);
+        _undoHistoryBytes = _undoHistoryBytes - prevBytes + a->GetByteSize();
+        _spilledBytes += a->GetSpilledByteSize();
+    }
+    for (const std::shared_ptr<Action> &a : _redoHistory)
+    {
+        a->MoveSpilled(_spillFile, newFile);
+        _spilledBytes += a->GetSpilledByteSize();
+    }
+
+    fclose(_spillFile);
+    _spillFile = newFile;
+    _spillFileBytes = _spilledBytes;
+}
+
+void MapMan::_ClearHistory()
+{
+    _undoHistory.clear();
+    _undoHistoryBytes = 0;
+    _redoHistory.clear();
+    _tileStroke.reset();
+    if (_spillFile)
+    {
+        fclose(_spillFile);
+        _spillFile = nullptr;
+    }
+    _spillFileBytes = _spilledBytes = 0;
+}
+
+bool MapMan::TileAction::Spill(FILE *file)
 {
-    TileGrid prevState = _tileGrid.Subsection(i, j, k, w, h, l);
-    TileGrid newState = TileGrid(w, h, l, _tileGrid.GetSpacing(), newTile);
+    if (!file || IsSpilled() || _runs.empty()) return false;
+
+    //Pack the tiles and runs into one buffer so that they are compressed together
+    const size_t tileBytes = _tiles.size() * sizeof(Tile), runBytes = _runs.size() * sizeof(Run);
+    std::vector<unsigned char> data(tileBytes + runBytes);
+    memcpy(data.data(), _tiles.data(), tileBytes);
+    memcpy(data.data() + tileBytes, _runs.data(), runBytes);
 
+    int compSize = 0;
+    unsigned char *compData = CompressData(data.data(), (int)data.size(), &compSize);
+    if (!compData) return false;
+
+    bool written = (fseek(file, 0, SEEK_END) == 0);
+    const long offset = ftell(file);
+    written = written && offset >= 0 && fwrite(compData, 1, compSize, file) == (size_t)compSize;
+    MemFree(compData);
+    if (!written)
+    {
+        std::cerr << "Error writing undo history to temporary file." << std::endl;
+        return false;
+    }
+
+    _spillOffset = offset;
+    _spillSize = compSize;
+    _spillTileCount = _tiles.size();
+    _spillRunCount = _runs.size();
+    std::vector<Tile>().swap(_tiles);
+    std::vector<Run>().swap(_runs);
+    return true;
+}
+
+MapMan::TileAction MapMan::TileAction::_Unspill(FILE *file) const
+{
+    TileAction action;
+
+    std::vector<unsigned char> compData(_spillSize);
+    if (!file || fseek(file, _spillOffset, SEEK_SET) != 0 || fread(compData.data(), 1, _spillSize, file) != (size_t)_spillSize)
+    {
+        std::cerr << "Error reading undo history from temporary file." << std::endl;
+        return action;
+    }
+
+    const size_t tileBytes = _spillTileCount * sizeof(Tile), runBytes = _spillRunCount * sizeof(Run);
+    int dataSize = 0;
+    unsigned char *data = DecompressData(compData.data(), _spillSize, &dataSize);
+    if (data && (size_t)dataSize == tileBytes + runBytes)
+    {
+        action._tiles.resize(_spillTileCount);
+        action._runs.resize(_spillRunCount);
+        memcpy(action._tiles.data(), data, tileBytes);
+        memcpy(action._runs.data(), data + tileBytes, runBytes);
+    }
+    else
+    {
+        std::cerr << "Error decompressing undo history from temporary file." << std::endl;
+    }
+    MemFree(data);
+    return action;
+}
+
+void MapMan::TileAction::MoveSpilled(FILE *from, FILE *to)
+{
+    if (!IsSpilled()) return;
+
+    std::vector<unsigned char> compData(_spillSize);
+    const bool read = from && fseek(from, _spillOffset, SEEK_SET) == 0 && fread(compData.data(), 1, _spillSize, from) == (size_t)_spillSize;
+    bool written = read && to && fseek(to, 0, SEEK_END) == 0;
+    const long offset = written ? ftell(to) : -1;
+    written = written && offset >= 0 && fwrite(compData.data(), 1, _spillSize, to) == (size_t)_spillSize;
+    if (written)
+    {
+        _spillOffset = offset;
+        return;
+    }
+
+    std::cerr << "Error moving undo history to new temporary file." << std::endl;
+    if (!read) return;
+    TileAction action = _Unspill(from);
+    _tiles = std::move(action._tiles);
+    _runs = std::move(action._runs);
+    _spillOffset = 0;
+    _spillSize = 0;
+    _spillTileCount = _spillRunCount = 0;
+}
+
+void MapMan::ExecuteTileAction(size_t i, size_t j, size_t k, size_t w, size_t h, size_t l, Tile newTile)
+{
+    auto fill = [&](int, int, int, const Tile &) { return newTile; };
+    if (_tileStroke)
+    {
+        _tileStroke->Add(*this, i, j, k, w, h, l, fill);
+        return;
+    }
     _Execute(std::static_pointer_cast<Action>(
-        std::make_shared<TileAction>(i, j, k, prevState, newState)
+        std::make_shared<TileAction>(_tileGrid, i, j, k, w, h, l, fill)
     ));
 }
 
 void MapMan::ExecuteTileAction(size_t i, size_t j, size_t k, size_t w, size_t h, size_t l, TileGrid brush)
 {
-    const TileGrid prevState = _tileGrid.Subsection(
-            i, j, k, 
-            Min(w, _tileGrid.GetWidth() - i),  //Cut off parts that go beyond map boundaries
-            Min(h, _tileGrid.GetHeight() - j), 
-            Min(l, _tileGrid.GetLength() - k)
-        );
-
-    TileGrid newState = prevState; //Copy the old state and merge the brush into it
-    newState.CopyTiles(0, 0, 0, brush, true);
-
+    //Empty tiles in the brush leave the map's tiles as they are
+    auto merge = [&](int x, int y, int z, const Tile &prevTile) {
+        Tile brushTile = brush.GetTile(x - i, y - j, z - k);
+        return brushTile ? brushTile : prevTile;
+    };
+    //Cut off parts that go beyond map boundaries
+    w = Min(w, _tileGrid.GetWidth() - i);
+    h = Min(h, _tileGrid.GetHeight() - j);
+    l = Min(l, _tileGrid.GetLength() - k);
+    if (_tileStroke)
+    {
+        _tileStroke->Add(*this, i, j, k, w, h, l, merge);
+        return;
+    }
     _Execute(std::static_pointer_cast<Action>(
-        std::make_shared<TileAction>(i, j, k, prevState, newState)
+        std::make_shared<TileAction>(_tileGrid, i, j, k, w, h, l, merge)
     ));
 }
 
+void MapMan::BeginTileStroke()
+{
+    EndTileStroke();
+    _tileStroke = std::make_shared<TileAction>();
+}
+
+void MapMan::EndTileStroke()
+{
+    if (_tileStroke && !_tileStroke->IsEmpty())
+    {
+        _tileStroke->EndRecording();
+        _AddToHistory(std::static_pointer_cast<Action>(_tileStroke));
+    }
+    _tileStroke.reset();
+}
+
 void MapMan::ExecuteEntPlacement(int i, int j, int k, Ent newEnt)
 {
     Ent prevEnt = _entGrid.HasEnt(i, j, k) ? _entGrid.GetEnt(i, j, k) : (Ent) { 0 };
@@ -80,57 +279,514 @@ void MapMan::ExecuteEntRemoval(int i, int j, int k)
     ));
 }
 
-bool MapMan::SaveTE3Map(fs::path filePath)
+//Binary .te3 files start with these characters, which a JSON document can't start with.
+#define TE3_BINARY_MAGIC "TE3B"
+#define TE3_BINARY_VERSION 1
+
+//Numbers in binary .te3 files are written and read as they are laid out in memory, which only gives little endian files on little endian machines.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "Binary .te3 files are little endian, but this target is not."
+#endif
+
+//The beginning of a binary .te3 file. Numbers are stored little endian, and offsets are from the start of the file.
+struct TE3BinaryHeader
 {
-    using namespace nlohmann;
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height, length;
+    uint32_t textureCount, shapeCount, paletteCount, entCount;
+    uint32_t reserved;
+    uint64_t texturesOffset; //Texture paths, each one being a uint32_t length followed by that many characters
+    uint64_t shapesOffset; //Shape paths, stored like the texture paths
+    uint64_t paletteOffset; //Unique tiles, whose texture and shape are indices into the lists of paths
+    uint64_t celsOffset; //The palette index of each cel as a TileID, in the order of the grid's flat indices
+    uint64_t entsOffset; //Entities, as written by WriteBinaryEnt()
+};
+
+static_assert(sizeof(Tile) == 16, "The binary .te3 format stores tiles as they are laid out in memory.");
+
+template<typename T>
+static inline void WriteBinary(std::ostream &out, const T &value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static inline void WriteBinaryString(std::ostream &out, const std::string &str)
+{
+    WriteBinary(out, (uint32_t)str.size());
+    out.write(str.data(), str.size());
+}
+
+//Pads the file with zeroes until its position is a multiple of `alignment`, and returns the new position.
+static inline uint64_t AlignBinary(std::ostream &out, uint64_t alignment)
+{
+    while ((uint64_t)out.tellp() % alignment != 0) out.put(0);
+    return (uint64_t)out.tellp();
+}
+
+static void WriteBinaryEnt(std::ostream &out, int i, int j, int k, const Ent &ent)
+{
+    WriteBinary(out, (int32_t)i);
+    WriteBinary(out, (int32_t)j);
+    WriteBinary(out, (int32_t)k);
+    WriteBinary(out, ent.color);
+    WriteBinary(out, ent.radius);
+    WriteBinary(out, (int32_t)ent.yaw);
+    WriteBinary(out, (int32_t)ent.pitch);
+    WriteBinary(out, (uint32_t)ent.properties.size());
+    for (const auto &[key, value] : ent.properties)
+    {
+        WriteBinaryString(out, key);
+        WriteBinaryString(out, value);
+    }
+}
+
+//Reads values from a block of memory, throwing an exception instead of reading past its end.
+class BinaryReader
+{
+public:
+    inline BinaryReader(const uint8_t *data, size_t size)
+        : _data(data), _size(size), _pos(0)
+    {
+    }
+
+    inline void Seek(uint64_t offset)
+    {
+        if (offset > _size) throw std::runtime_error("Offset is past the end of the file.");
+        _pos = offset;
+    }
+
+    //Returns a pointer to the next `count` bytes and moves past them.
+    inline const uint8_t *Take(uint64_t count)
+    {
+        if (count > _size - _pos) throw std::runtime_error("Unexpected end of file.");
+        const uint8_t *ptr = _data + _pos;
+        _pos += count;
+        return ptr;
+    }
+
+    template<typename T>
+    inline T Read()
+    {
+        T value;
+        memcpy(&value, Take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    inline std::string ReadString()
+    {
+        const uint32_t length = Read<uint32_t>();
+        return std::string(reinterpret_cast<const char *>(Take(length)), length);
+    }
+private:
+    const uint8_t *_data;
+    size_t _size;
+    size_t _pos;
+};
+
+//Gives read-only access to the contents of a file. On Linux, the file is memory-mapped instead of being read all at once.
+class MappedFile
+{
+public:
+    inline MappedFile(const fs::path &path)
+        : _data(nullptr), _size(0), _mapped(false)
+    {
+#ifdef LINUX_64
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED)
+            {
+                _data = reinterpret_cast<const uint8_t *>(mapping);
+                _size = info.st_size;
+                _mapped = true;
+            }
+        }
+        if (fd >= 0) close(fd);
+        if (_mapped) return;
+#endif
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) return;
+        _buffer.resize((size_t)file.tellg());
+        file.seekg(0);
+        file.read(reinterpret_cast<char *>(_buffer.data()), _buffer.size());
+        _data = _buffer.data();
+        _size = (size_t)file.gcount();
+    }
+
+    inline ~MappedFile()
+    {
+#ifdef LINUX_64
+        if (_mapped) munmap(const_cast<uint8_t *>(_data), _size);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    inline const uint8_t *GetData() const { return _data; }
+    inline size_t GetSize() const { return _size; }
+private:
+    const uint8_t *_data;
+    size_t _size;
+    bool _mapped;
+    std::vector<uint8_t> _buffer; //Holds the file's contents when it isn't mapped
+};
+
+//Receives the contents of a JSON .te3 file from nlohmann::json::sax_parse() without building a document for the whole file.
+//The tile data string is moved out as soon as it is read, each entity is converted as soon as its object ends,
+//and only the rest of the values in "tiles" (the small ones) are assembled into JSON.
+class TE3SaxHandler : public nlohmann::json_sax<nlohmann::json>
+{
+public:
+    nlohmann::json tilesInfo; //Everything in "tiles" except for "data"
+    std::string tileData;
+    std::vector<Ent> ents;
+
+    inline bool null() override { return _Value(nullptr); }
+    inline bool boolean(bool val) override { return _Value(val); }
+    inline bool number_integer(number_integer_t val) override { return _Value(val); }
+    inline bool number_unsigned(number_unsigned_t val) override { return _Value(val); }
+    inline bool number_float(number_float_t val, const string_t &) override { return _Value(val); }
+    inline bool binary(binary_t &val) override { return _Value(std::move(val)); }
+
+    inline bool string(string_t &val) override
+    {
+        if (_stack.size() == 1 && _stack.back() == &tilesInfo && _key == "data")
+        {
+            tileData = std::move(val);
+            return true;
+        }
+        return _Value(std::move(val));
+    }
+
+    inline bool key(string_t &val) override
+    {
+        _key = val;
+        return true;
+    }
+
+    inline bool start_object(std::size_t) override { return _Open(nlohmann::json::object()); }
+    inline bool end_object() override { return _Close(); }
+    inline bool start_array(std::size_t) override { return _Open(nlohmann::json::array()); }
+    inline bool end_array() override { return _Close(); }
+
+    inline bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &ex) override
+    {
+        throw std::runtime_error(ex.what());
+    }
+private:
+    nlohmann::json _ent; //The entity being read
+    nlohmann::json _ignored; //Holds anything outside of "tiles" and "ents"
+    std::vector<nlohmann::json *> _stack; //The values being built, innermost last
+    std::string _section; //The key of the root object's member that is being read
+    std::string _key;
+    int _depth = 0;
+
+    inline bool _Value(nlohmann::json &&val)
+    {
+        if (_stack.empty()) return true;
+        nlohmann::json &parent = *_stack.back();
+        if (parent.is_object()) parent[_key] = std::move(val);
+        else parent.push_back(std::move(val));
+        return true;
+    }
+
+    inline bool _Open(nlohmann::json &&container)
+    {
+        ++_depth;
+        if (!_stack.empty())
+        {
+            nlohmann::json &parent = *_stack.back();
+            if (parent.is_object())
+            {
+                parent[_key] = std::move(container);
+                _stack.push_back(&parent[_key]);
+            }
+            else
+            {
+                parent.push_back(std::move(container));
+                _stack.push_back(&parent.back());
+            }
+        }
+        else if (_depth == 2)
+        {
+            _section = _key;
+            if (_section == "tiles") _stack.push_back(&(tilesInfo = std::move(container)));
+            else if (_section != "ents") _stack.push_back(&(_ignored = std::move(container)));
+        }
+        else if (_depth == 3 && _section == "ents")
+        {
+            _stack.push_back(&(_ent = std::move(container)));
+        }
+        return true;
+    }
+
+    inline bool _Close()
+    {
+        --_depth;
+        if (_stack.empty()) return true;
+        const nlohmann::json *closed = _stack.back();
+        _stack.pop_back();
+        if (closed == &_ent && _ent.is_object()) ents.push_back(_ent.get<Ent>());
+        return true;
+    }
+};
+
+void MapMan::_WriteTE3Binary(std::ostream &file, const TileGrid &tileGrid, const EntGrid &entGrid, const TilePalettePaths &palettePaths)
+{
+    std::set<fs::path> usedTextures = tileGrid.GetUsedTexturePaths(palettePaths);
+    std::set<fs::path> usedShapes = tileGrid.GetUsedShapePaths(palettePaths);
+    std::vector<fs::path> textures(usedTextures.begin(), usedTextures.end());
+    std::vector<fs::path> shapes(usedShapes.begin(), usedShapes.end());
+    std::vector<Tile> palette;
+    std::vector<TileID> cels;
+    tileGrid.GetTileDataBinary(textures, shapes, palettePaths, palette, cels);
+
+    TE3BinaryHeader header = {};
+    memcpy(header.magic, TE3_BINARY_MAGIC, sizeof(header.magic));
+    header.version = TE3_BINARY_VERSION;
+    header.width = tileGrid.GetWidth();
+    header.height = tileGrid.GetHeight();
+    header.length = tileGrid.GetLength();
+    header.textureCount = textures.size();
+    header.shapeCount = shapes.size();
+    header.paletteCount = palette.size();
+
+    WriteBinary(file, header); //Written again once the offsets are known
+
+    header.texturesOffset = (uint64_t)file.tellp();
+    for (const fs::path &path : textures) WriteBinaryString(file, path.generic_string());
+    header.shapesOffset = (uint64_t)file.tellp();
+    for (const fs::path &path : shapes) WriteBinaryString(file, path.generic_string());
+
+    //Align the tiles so that they can be used straight from a mapped file.
+    header.paletteOffset = AlignBinary(file, alignof(Tile));
+    file.write(reinterpret_cast<const char *>(palette.data()), palette.size() * sizeof(Tile));
+    header.celsOffset = AlignBinary(file, alignof(TileID));
+    file.write(reinterpret_cast<const char *>(cels.data()), cels.size() * sizeof(TileID));
+
+    header.entsOffset = (uint64_t)file.tellp();
+    entGrid.ForEachOccupied([&](int x, int y, int z, const Ent &ent) {
+        WriteBinaryEnt(file, x, y, z, ent);
+        ++header.entCount;
+    });
+
+    file.seekp(0);
+    WriteBinary(file, header);
+}
+
+bool MapMan::_LoadTE3Binary(fs::path filePath)
+{
+    MappedFile mappedFile(filePath);
+    BinaryReader reader(mappedFile.GetData(), mappedFile.GetSize());
 
     try
     {
-        json jData;
-        jData["tiles"] = _tileGrid;
-        jData["ents"] = _entGrid.GetEntList();
+        const TE3BinaryHeader header = reader.Read<TE3BinaryHeader>();
+        if (memcmp(header.magic, TE3_BINARY_MAGIC, sizeof(header.magic)) != 0) throw std::runtime_error("Not a binary .te3 file.");
+        if (header.version != TE3_BINARY_VERSION) throw std::runtime_error("Unsupported binary .te3 version.");
+        if (header.width > UINT16_MAX || header.height > UINT16_MAX || header.length > UINT16_MAX) throw std::runtime_error("Invalid map size.");
+        if (header.paletteCount == 0 || header.paletteCount > TILE_PALETTE_MAX) throw std::runtime_error("Invalid tile palette size.");
 
-        std::ofstream file(filePath);
-        file << to_string(jData);
+        std::vector<fs::path> textures, shapes;
+        reader.Seek(header.texturesOffset);
+        for (uint32_t t = 0; t < header.textureCount; ++t) textures.push_back(reader.ReadString());
+        reader.Seek(header.shapesOffset);
+        for (uint32_t s = 0; s < header.shapeCount; ++s) shapes.push_back(reader.ReadString());
+        //Each path must be listed once, so that reloading the assets from the lists gives each one its index as its ID.
+        if (std::set<fs::path>(textures.begin(), textures.end()).size() != textures.size() || std::set<fs::path>(shapes.begin(), shapes.end()).size() != shapes.size())
+        {
+            throw std::runtime_error("A texture or shape is listed more than once.");
+        }
 
-        if (file.fail()) return false;
+        reader.Seek(header.paletteOffset);
+        std::vector<Tile> palette(header.paletteCount);
+        memcpy(palette.data(), reader.Take(palette.size() * sizeof(Tile)), palette.size() * sizeof(Tile));
+        if (palette[0]) throw std::runtime_error("The first tile in the palette must be empty.");
+        for (size_t id = 1; id < palette.size(); ++id)
+        {
+            if (palette[id].texture < 0 || palette[id].texture >= (int)textures.size() || palette[id].shape < 0 || palette[id].shape >= (int)shapes.size())
+            {
+                throw std::runtime_error("Tile refers to a texture or shape that isn't listed.");
+            }
+        }
+
+        //The cels are used directly from the file's memory.
+        if (header.celsOffset % alignof(TileID) != 0) throw std::runtime_error("Misaligned tile data.");
+        reader.Seek(header.celsOffset);
+        const size_t celCount = (size_t)header.width * header.height * header.length;
+        const TileID *cels = reinterpret_cast<const TileID *>(reader.Take(celCount * sizeof(TileID)));
+        for (size_t c = 0; c < celCount; ++c)
+        {
+            if (cels[c] >= palette.size()) throw std::runtime_error("Tile data refers to a tile that isn't in the palette.");
+        }
+
+        struct PlacedEnt { int i, j, k; Ent ent; };
+        std::vector<PlacedEnt> ents(header.entCount);
+        reader.Seek(header.entsOffset);
+        for (PlacedEnt &e : ents)
+        {
+            e.i = reader.Read<int32_t>();
+            e.j = reader.Read<int32_t>();
+            e.k = reader.Read<int32_t>();
+            if (e.i < 0 || e.j < 0 || e.k < 0 || e.i >= (int)header.width || e.j >= (int)header.height || e.k >= (int)header.length)
+            {
+                throw std::runtime_error("Entity is outside of the map.");
+            }
+            e.ent.color = reader.Read<Color>();
+            e.ent.radius = reader.Read<float>();
+            e.ent.yaw = reader.Read<int32_t>();
+            e.ent.pitch = reader.Read<int32_t>();
+            const uint32_t propertyCount = reader.Read<uint32_t>();
+            for (uint32_t p = 0; p < propertyCount; ++p)
+            {
+                std::string key = reader.ReadString();
+                e.ent.properties[key] = reader.ReadString();
+            }
+        }
+
+        //Like with JSON files, the map is built in temporary grids, and the current one is only replaced once nothing else can fail.
+        TileGrid tileGrid(header.width, header.height, header.length);
+        tileGrid.SetTileDataBinary(palette, cels);
+        EntGrid entGrid(header.width, header.height, header.length);
+        for (PlacedEnt &e : ents)
+        {
+            e.ent.position = entGrid.GridToWorldPos((Vector3) { (float)e.i, (float)e.j, (float)e.k }, true);
+            entGrid.AddEnt(e.i, e.j, e.k, e.ent);
+        }
+
+        _ClearHistory();
+        Assets::Clear();
+        Assets::LoadTextureIDs(textures);
+        Assets::LoadShapeIDs(shapes);
+        _tileGrid = std::move(tileGrid);
+        _entGrid = std::move(entGrid);
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "Error loading binary .te3 map: " << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool MapMan::SaveTE3Map(fs::path filePath, bool binary)
+{
+    return _WriteTE3Map(filePath, binary, _tileGrid, _entGrid, _tileGrid.GetPalettePaths());
+}
+
+std::future<bool> MapMan::SaveTE3MapAsync(fs::path filePath, bool binary)
+{
+    //Copying the grids only copies pointers to their chunks, which stay shared until the editor changes them,
+    //and the asset paths are looked up now, so the worker thread only reads data that nothing else can change.
+    return std::async(std::launch::async, 
+        [filePath, binary, tileGrid = _tileGrid, entGrid = _entGrid, palettePaths = _tileGrid.GetPalettePaths()]() {
+            return _WriteTE3Map(filePath, binary, tileGrid, entGrid, palettePaths);
+        }
+    );
+}
+
+bool MapMan::_WriteTE3Map(fs::path filePath, bool binary, const TileGrid &tileGrid, const EntGrid &entGrid, const TilePalettePaths &palettePaths)
+{
+    //The map is written to a temporary file that replaces the real one once it's complete, so that a failed save doesn't ruin the existing file.
+    fs::path tempPath = filePath;
+    tempPath += ".tmp";
+
+    try
+    {
+        std::ofstream file(tempPath, std::ios::binary);
+        if (binary) _WriteTE3Binary(file, tileGrid, entGrid, palettePaths);
+        else _WriteTE3Json(file, tileGrid, entGrid, palettePaths);
+        file.close();
+
+        if (file.fail()) throw std::runtime_error("Failed to write to '" + tempPath.string() + "'.");
+        fs::rename(tempPath, filePath);
     }
     catch (const std::exception &e)
     {
         std::cout << e.what() << std::endl;
+        std::error_code err;
+        fs::remove(tempPath, err);
         return false;
     }
     catch (...)
     {
+        std::error_code err;
+        fs::remove(tempPath, err);
         return false;
     }
 
     return true;
 }
 
+void MapMan::_WriteTE3Json(std::ostream &file, const TileGrid &tileGrid, const EntGrid &entGrid, const TilePalettePaths &palettePaths)
+{
+    using namespace nlohmann;
+
+    //The JSON is written out piece by piece instead of being built as one document first, so that large maps aren't held in memory several times over.
+    //The keys are in the same (alphabetical) order that nlohmann::json would put them in.
+    file << "{\"ents\":[";
+    bool firstEnt = true;
+    entGrid.ForEachOccupied([&](int, int, int, const Ent &ent) {
+        if (!firstEnt) file << ',';
+        file << json(ent).dump();
+        firstEnt = false;
+    });
+
+    std::set<fs::path> usedTextures = tileGrid.GetUsedTexturePaths(palettePaths);
+    std::set<fs::path> usedShapes = tileGrid.GetUsedShapePaths(palettePaths);
+    file << "],\"tiles\":{\"data\":\"";
+    tileGrid.WriteTileDataBase64(file, usedTextures, usedShapes, palettePaths);
+    file << "\",\"dataVersion\":" << TILE_DATA_VERSION_RLE;
+    file << ",\"height\":" << tileGrid.GetHeight();
+    file << ",\"length\":" << tileGrid.GetLength();
+    file << ",\"shapes\":" << json(usedShapes).dump();
+    file << ",\"textures\":" << json(usedTextures).dump();
+    file << ",\"width\":" << tileGrid.GetWidth() << "}}";
+}
+
 bool MapMan::LoadTE3Map(fs::path filePath)
 {
-    _undoHistory.clear();
-    _redoHistory.clear();
-    
     using namespace nlohmann;
 
-    std::ifstream file(filePath);
-    json jData;
-    file >> jData;
+    std::ifstream file(filePath, std::ios::binary);
+    char magic[sizeof(TE3_BINARY_MAGIC) - 1] = {};
+    file.read(magic, sizeof(magic));
+    if (file && memcmp(magic, TE3_BINARY_MAGIC, sizeof(magic)) == 0) return _LoadTE3Binary(filePath);
+    file.clear();
+    file.seekg(0);
 
     try
     {
-        Assets::Clear();
-        Assets::LoadTextureIDs(jData.at("tiles").at("textures"));
-        Assets::LoadShapeIDs(jData.at("tiles").at("shapes"));
-        _tileGrid = jData.at("tiles");
-        _entGrid = EntGrid(_tileGrid.GetWidth(), _tileGrid.GetHeight(), _tileGrid.GetLength());
-        for (const Ent& e : jData.at("ents").get<std::vector<Ent>>())
+        //The file is parsed as a stream of values instead of into a document, so that the tile data is only held in memory once as text.
+        TE3SaxHandler handler;
+        json::sax_parse(file, &handler);
+        if (handler.tilesInfo.is_null()) throw std::runtime_error("The map has no tiles.");
+
+        //The map is decoded into temporary grids, so that a file that fails to load leaves the current map, its assets, and its history as they were.
+        //The tiles refer to textures and shapes by their indices in the file's lists, which become their IDs once the assets are reloaded from those lists.
+        const std::vector<fs::path> textures = handler.tilesInfo.at("textures");
+        const std::vector<fs::path> shapes = handler.tilesInfo.at("shapes");
+        TileGrid tileGrid(handler.tilesInfo.at("width"), handler.tilesInfo.at("height"), handler.tilesInfo.at("length"), TILE_SPACING_DEFAULT, Tile());
+        tileGrid.SetTileDataBase64(std::move(handler.tileData), handler.tilesInfo.value("dataVersion", TILE_DATA_VERSION_RAW));
+        EntGrid entGrid(tileGrid.GetWidth(), tileGrid.GetHeight(), tileGrid.GetLength());
+        for (Ent& e : handler.ents)
         {
-            Vector3 gridPos = _entGrid.WorldToGridPos(e.position);
-            _entGrid.AddEnt((int) gridPos.x, (int) gridPos.y, (int) gridPos.z, e);
+            Vector3 gridPos = entGrid.WorldToGridPos(e.position);
+            e.position = entGrid.GridToWorldPos(gridPos, true); //Entities are kept at the centers of their cels
+            entGrid.AddEnt((int) gridPos.x, (int) gridPos.y, (int) gridPos.z, e);
         }
+
+        _ClearHistory();
+        Assets::Clear();
+        Assets::LoadTextureIDs(textures);
+        Assets::LoadShapeIDs(shapes);
+        _tileGrid = std::move(tileGrid);
+        _entGrid = std::move(entGrid);
     }
     catch (const std::exception &e)
     {
@@ -142,8 +798,6 @@ bool MapMan::LoadTE3Map(fs::path filePath)
         return false;
     }
 
-    if (file.fail()) return false;
-
     return true;
 }
 
@@ -156,7 +810,7 @@ static inline std::string GetDataURI(void *buffer, size_t byteCount)
 #define COMP_TYPE_FLOAT 5126
 #define COMP_TYPE_UBYTE 5121
 
-bool MapMan::ExportGLTFScene(fs::path filePath, bool separateGeometry)
+bool MapMan::ExportGLTFScene(fs::path filePath, bool separateGeometry, bool mergeFaces)
 {
     using namespace nlohmann;
 
@@ -201,7 +855,7 @@ bool MapMan::ExportGLTFScene(fs::path filePath, bool separateGeometry)
         };
 
         //Generate primitives and buffers for map geometry.
-        const Model& mapModel = _tileGrid.GetModel();
+        const Model& mapModel = _tileGrid.GetModel(mergeFaces);
         std::vector<json> mapPrims;
         mapPrims.reserve(mapModel.meshCount);
         for (int i = 0; i < mapModel.meshCount; ++i)
@@ -286,7 +940,7 @@ bool MapMan::ExportGLTFScene(fs::path filePath, bool separateGeometry)
                     {"NORMAL", normalIdx}
                     // {"COLOR_0", colorIdx}
                 }},
-                {"material", i}
+                {"material", mapModel.meshMaterial[i]}
             });
         }
 
@@ -354,19 +1008,18 @@ bool MapMan::ExportGLTFScene(fs::path filePath, bool separateGeometry)
                 json materialNode;
                 materialNode["name"] = nodeName;
 
-                //Add children for each mesh with that material
+                //Large maps can have several meshes with the same material, so they all go into one mesh as separate primitives
+                std::vector<json> materialPrims;
                 for (int mm = 0; mm < mapModel.meshCount; ++mm)
                 {
-                    if (mat.maps == mapModel.materials[mapModel.meshMaterial[mm]].maps)
-                    {
-                        json mesh = {
-                            {"primitives", {mapPrims[mm]}}
-                        };
-
-                        materialNode["mesh"] = meshes.size();
-                        meshes.push_back(mesh);
-                        break;
-                    }
+                    if (mapModel.meshMaterial[mm] == m) materialPrims.push_back(mapPrims[mm]);
+                }
+                if (!materialPrims.empty())
+                {
+                    json mesh;
+                    mesh["primitives"] = materialPrims;
+                    materialNode["mesh"] = meshes.size();
+                    meshes.push_back(mesh);
                 }
                 if (materialNode.find("mesh") == materialNode.end())
                 {
@@ -23,7 +23,9 @@
 
 #include <deque>
 #include <cstdint>
+#include <cstdio>
 #include <memory>
+#include <future>
 #include <filesystem>
 namespace fs = std::filesystem;
 
@@ -39,29 +41,149 @@ public:
     public:
         virtual void Do(MapMan &map) const = 0;
         virtual void Undo(MapMan &map) const = 0;
+        //Returns the approximate number of bytes of memory taken up by the action.
+        virtual size_t GetByteSize() const = 0;
+        //Moves the action's data into the file to free up memory, if the action supports that. Returns true if it did.
+        inline virtual bool Spill(FILE *) { return false; }
+        //Returns the number of bytes of the action's data that are in the spill file.
+        inline virtual size_t GetSpilledByteSize() const { return 0; }
+        //Copies the action's spilled data into another spill file, when the spill file is compacted.
+        //If that fails, the data is read back into memory so that it isn't lost along with the old file.
+        inline virtual void MoveSpilled(FILE *, FILE *) {}
     };
 
+    //Stores only the cels that an action changes, as runs of neighboring cels along the X axis with the same old and new tiles.
+    //This way, its size depends on the number of changed cels and how varied they are rather than on the size of the area.
     class TileAction : public Action
     {
     public:
-        inline TileAction(size_t i, size_t j, size_t k, TileGrid prevState, TileGrid newState)
-            : _i(i), _j(j), _k(k), _prevState(prevState), _newState(newState)
+        //Constructs an action that doesn't change anything yet.
+        inline TileAction()
         {
         }
+
+        //Records the changes made by setting each cel inside of the rectangular prism at (i, j, k) with size (w, h, l) to `newTileAt(x, y, z, prevTile)`.
+        //Must be called before the change is made, with the grid that will be changed.
+        template<typename F>
+        inline TileAction(const TileGrid &grid, int i, int j, int k, int w, int h, int l, F newTileAt)
+        {
+            _Record(grid, i, j, k, w, h, l, newTileAt);
+            EndRecording();
+        }
+
+        //Records more changes like the constructor does, and makes them right away. Used to build up one action out of a series of edits.
+        template<typename F>
+        inline void Add(MapMan &map, int i, int j, int k, int w, int h, int l, F newTileAt)
+        {
+            const size_t firstRun = _runs.size();
+            //A run that the new changes extend has already been made, but making it again doesn't change anything.
+            _Record(map._tileGrid, i, j, k, w, h, l, newTileAt);
+            for (size_t r = (firstRun > 0) ? firstRun - 1 : 0; r < _runs.size(); ++r) _Apply(map, _runs[r], _tiles[_runs[r].newID]);
+        }
+
+        //Frees the memory used to look up tiles while changes are being recorded. Call once no more changes will be added.
+        inline void EndRecording()
+        {
+            std::unordered_map<Tile, TileID, TileHash>().swap(_tileLookup);
+        }
         
         inline virtual void Do(MapMan &map) const override
         {
-            map._tileGrid.CopyTiles(_i, _j, _k, _newState);
+            if (IsSpilled())
+            {
+                _Unspill(map._spillFile).Do(map);
+                return;
+            }
+            for (const Run &run : _runs) _Apply(map, run, _tiles[run.newID]);
         }
 
         inline virtual void Undo(MapMan &map) const override
         {
-            map._tileGrid.CopyTiles(_i, _j, _k, _prevState);
+            if (IsSpilled())
+            {
+                _Unspill(map._spillFile).Undo(map);
+                return;
+            }
+            //The same cels can be changed more than once, so the runs are undone in reverse.
+            for (auto run = _runs.rbegin(); run != _runs.rend(); ++run) _Apply(map, *run, _tiles[run->prevID]);
         }
 
-        size_t _i, _j, _k;
-        TileGrid _prevState;
-        TileGrid _newState;
+        inline virtual size_t GetByteSize() const override
+        {
+            return sizeof(*this) + (_tiles.capacity() * sizeof(Tile)) + (_runs.capacity() * sizeof(Run));
+        }
+
+        //Compresses the tiles and runs and appends them to the file.
+        virtual bool Spill(FILE *file) override;
+        inline virtual size_t GetSpilledByteSize() const override { return IsSpilled() ? _spillSize : 0; }
+        virtual void MoveSpilled(FILE *from, FILE *to) override;
+
+        //Returns true if the action's data is in the spill file instead of memory.
+        inline bool IsSpilled() const { return _spillSize > 0; }
+        //Returns true if the action doesn't change any cels.
+        inline bool IsEmpty() const { return _runs.empty() && !IsSpilled(); }
+    protected:
+        struct Run
+        {
+            size_t start; //Flat index of the first cel
+            uint32_t length; //Number of cels along the X axis
+            TileID prevID, newID; //Indices into `_tiles`
+        };
+
+        template<typename F>
+        inline void _Record(const TileGrid &grid, int i, int j, int k, int w, int h, int l, F newTileAt)
+        {
+            auto tileIndex = [&](const Tile &tile) {
+                auto [iter, inserted] = _tileLookup.try_emplace(tile, (TileID)_tiles.size());
+                if (inserted) _tiles.push_back(tile);
+                return iter->second;
+            };
+
+            for (int y = j; y < j + h; ++y)
+            {
+                for (int z = k; z < k + l; ++z)
+                {
+                    for (int x = i; x < i + w; ++x)
+                    {
+                        const Tile prevTile = grid.GetTile(x, y, z);
+                        Tile newTile = newTileAt(x, y, z, prevTile);
+                        if (!newTile) newTile = Tile(); //All empty tiles are treated the same.
+                        if (newTile == prevTile) continue;
+
+                        const TileID prevID = tileIndex(prevTile), newID = tileIndex(newTile);
+                        const size_t index = grid.FlatIndex(x, y, z);
+                        if (x > 0 && !_runs.empty() && _runs.back().start + _runs.back().length == index && 
+                            _runs.back().prevID == prevID && _runs.back().newID == newID)
+                        {
+                            _runs.back().length += 1;
+                        }
+                        else
+                        {
+                            _runs.push_back((Run) { index, 1, prevID, newID });
+                        }
+                    }
+                }
+            }
+        }
+
+        inline void _Apply(MapMan &map, const Run &run, const Tile &tile) const
+        {
+            Vector3 pos = map._tileGrid.UnflattenIndex(run.start);
+            map._tileGrid.SetTileRect((int)pos.x, (int)pos.y, (int)pos.z, run.length, 1, 1, tile);
+        }
+
+        //Reads the action's data back from the spill file into a new action that isn't spilled.
+        TileAction _Unspill(FILE *file) const;
+
+        std::vector<Tile> _tiles; //The unique tiles referred to by the runs
+        std::vector<Run> _runs;
+        //Maps each of `_tiles` to its index. Kept between calls to Add() so that each one doesn't have to rebuild it.
+        std::unordered_map<Tile, TileID, TileHash> _tileLookup;
+
+        //Location of the compressed data in the spill file
+        long _spillOffset = 0;
+        int _spillSize = 0;
+        size_t _spillTileCount = 0, _spillRunCount = 0;
     };
 
     class EntAction : public Action
@@ -95,6 +217,16 @@ public:
                 map._entGrid.RemoveEnt(_i, _j, _k);
             }
         }
+
+        inline virtual size_t GetByteSize() const override
+        {
+            size_t size = sizeof(*this);
+            for (const Ent *ent : { &_oldEnt, &_newEnt })
+            {
+                for (const auto &[key, value] : ent->properties) size += sizeof(std::pair<std::string, std::string>) + key.capacity() + value.capacity();
+            }
+            return size;
+        }
     protected:
         size_t _i, _j, _k;
         bool _overwrite; //Indicates if there was an entity underneath the one placed that must be restored when undoing.
@@ -103,13 +235,95 @@ public:
         Ent  _newEnt;
     };
 
+    //Changes the size of the map. Only the tiles and entities that get cut off are stored, so that they can be put back when undoing.
+    class ResizeAction : public Action
+    {
+    public:
+        //Records resizing the map to (width, height, length) while moving its contents by (ofsX, ofsY, ofsZ).
+        //Must be called before the map is resized.
+        inline ResizeAction(const MapMan &map, int ofsX, int ofsY, int ofsZ, size_t width, size_t height, size_t length)
+            : _ofsX(ofsX), _ofsY(ofsY), _ofsZ(ofsZ),
+              _oldWidth(map._tileGrid.GetWidth()), _oldHeight(map._tileGrid.GetHeight()), _oldLength(map._tileGrid.GetLength()),
+              _newWidth(width), _newHeight(height), _newLength(length)
+        {
+            auto erase = [](int, int, int, const Tile &) { return Tile(); };
+            map._tileGrid.ForEachCutBox(ofsX, ofsY, ofsZ, width, height, length, [&](int i, int j, int k, int w, int h, int l) {
+                _cutTiles.emplace_back(map._tileGrid, i, j, k, w, h, l, erase);
+                if (_cutTiles.back().IsEmpty()) _cutTiles.pop_back();
+            });
+            map._entGrid.ForEachCutBox(ofsX, ofsY, ofsZ, width, height, length, [&](int i, int j, int k, int w, int h, int l) {
+                map._entGrid.ForEachOccupied(i, j, k, w, h, l, [&](int x, int y, int z, const Ent &ent) {
+                    _cutEnts.push_back((CutEnt) { x, y, z, ent });
+                });
+            });
+        }
+
+        inline virtual void Do(MapMan &map) const override
+        {
+            map._tileGrid.Resize(_ofsX, _ofsY, _ofsZ, _newWidth, _newHeight, _newLength);
+            map._entGrid.Resize(_ofsX, _ofsY, _ofsZ, _newWidth, _newHeight, _newLength);
+        }
+
+        inline virtual void Undo(MapMan &map) const override
+        {
+            map._tileGrid.Resize(-_ofsX, -_ofsY, -_ofsZ, _oldWidth, _oldHeight, _oldLength);
+            map._entGrid.Resize(-_ofsX, -_ofsY, -_ofsZ, _oldWidth, _oldHeight, _oldLength);
+            //The cut off tiles were recorded as being erased, so undoing that puts them back.
+            for (const TileAction &cut : _cutTiles) cut.Undo(map);
+            for (const CutEnt &cut : _cutEnts) map._entGrid.AddEnt(cut.i, cut.j, cut.k, cut.ent);
+        }
+
+        inline virtual size_t GetByteSize() const override
+        {
+            size_t size = sizeof(*this) + (_cutEnts.capacity() * sizeof(CutEnt));
+            for (const TileAction &cut : _cutTiles) size += cut.GetByteSize();
+            for (const CutEnt &cut : _cutEnts)
+            {
+                for (const auto &[key, value] : cut.ent.properties) size += sizeof(std::pair<std::string, std::string>) + key.capacity() + value.capacity();
+            }
+            return size;
+        }
+
+        inline virtual bool Spill(FILE *file) override
+        {
+            bool spilled = false;
+            for (TileAction &cut : _cutTiles) spilled = cut.Spill(file) || spilled;
+            return spilled;
+        }
+
+        inline virtual size_t GetSpilledByteSize() const override
+        {
+            size_t size = 0;
+            for (const TileAction &cut : _cutTiles) size += cut.GetSpilledByteSize();
+            return size;
+        }
+
+        inline virtual void MoveSpilled(FILE *from, FILE *to) override
+        {
+            for (TileAction &cut : _cutTiles) cut.MoveSpilled(from, to);
+        }
+    protected:
+        struct CutEnt
+        {
+            int i, j, k;
+            Ent ent;
+        };
+
+        int _ofsX, _ofsY, _ofsZ;
+        size_t _oldWidth, _oldHeight, _oldLength;
+        size_t _newWidth, _newHeight, _newLength;
+        std::vector<TileAction> _cutTiles; //Erasing the cut off tiles, one for each side of the map that was cut
+        std::vector<CutEnt> _cutEnts;
+    };
+
+    inline MapMan() : _undoHistoryBytes(0), _spillFile(nullptr), _spillFileBytes(0), _spilledBytes(0) {}
+    inline ~MapMan() { if (_spillFile) fclose(_spillFile); }
     
     inline void NewMap(int width, int height, int length) 
     {
         _tileGrid = TileGrid(width, height, length);
         _entGrid = EntGrid(width, height, length);
-        _undoHistory.clear();
-        _redoHistory.clear();
+        _ClearHistory();
     }
 
     inline const TileGrid& Tiles() const { return _tileGrid; }
@@ -126,7 +340,7 @@ public:
         _entGrid.DrawLabels(camera, fromY, toY);
     }
 
-    //Regenerates the map, extending one of the grid's dimensions on the given axis. Returns false if the change would result in an invalid map size.
+    //Extends one of the grid's dimensions on the given axis, as an undoable action.
     inline void ExpandMap(Direction axis, int amount)
     {
         int newWidth  = _tileGrid.GetWidth();
@@ -145,14 +359,9 @@ public:
             case Direction::Y_POS: newHeight += amount; break;
         }
 
-        _undoHistory.clear();
-        _redoHistory.clear();
-        TileGrid oldTiles = _tileGrid;
-        EntGrid oldEnts = _entGrid;
-        _tileGrid = TileGrid(newWidth, newHeight, newLength);
-        _entGrid = EntGrid(newWidth, newHeight, newLength);       
-        _tileGrid.CopyTiles(ofsx, ofsy, ofsz, oldTiles, false);
-        _entGrid.CopyEnts(ofsx, ofsy, ofsz, oldEnts);
+        _Execute(std::static_pointer_cast<Action>(
+            std::make_shared<ResizeAction>(*this, ofsx, ofsy, ofsz, newWidth, newHeight, newLength)
+        ));
     }
 
     //Reduces the size of the grid until it fits perfectly around all the non-empty cels in the map.
@@ -162,47 +371,46 @@ public:
         size_t maxX, maxY, maxZ;
         minX = minY = minZ = UINT64_MAX;
         maxX = maxY = maxZ = 0;
-        for (size_t x = 0; x < _tileGrid.GetWidth(); ++x)
+        auto expandBounds = [&](size_t x, size_t y, size_t z, const auto &)
         {
-            for (size_t y = 0; y < _tileGrid.GetHeight(); ++y)
-            {
-                for (size_t z = 0; z < _tileGrid.GetLength(); ++z)
-                {
-                    if (_tileGrid.GetTile(x, y, z) || _entGrid.HasEnt(x, y, z))
-                    {
-                        if (x < minX) minX = x;
-                        if (y < minY) minY = y;
-                        if (z < minZ) minZ = z;
-                        if (x > maxX) maxX = x;
-                        if (y > maxY) maxY = y;
-                        if (z > maxZ) maxZ = z;
-                    }
-                }
-            }
-        }
+            if (x < minX) minX = x;
+            if (y < minY) minY = y;
+            if (z < minZ) minZ = z;
+            if (x > maxX) maxX = x;
+            if (y > maxY) maxY = y;
+            if (z > maxZ) maxZ = z;
+        };
+        _tileGrid.ForEachOccupied(expandBounds);
+        _entGrid.ForEachOccupied(expandBounds);
         if (minX > maxX || minY > maxY || minZ > maxZ)
         {
             //If there aren't any tiles, just make it 1x1x1.
-            _tileGrid = TileGrid(1, 1, 1);
-            _entGrid = EntGrid(1, 1, 1);
-        }
-        else
-        {
-            _tileGrid = _tileGrid.Subsection(minX, minY, minZ, maxX - minX + 1, maxY - minY + 1, maxZ - minZ + 1);
-            _entGrid = _entGrid.Subsection(minX, minY, minZ, maxX - minX + 1, maxY - minY + 1, maxZ - minZ + 1);
+            minX = minY = minZ = maxX = maxY = maxZ = 0;
         }
+
+        const size_t newWidth = maxX - minX + 1, newHeight = maxY - minY + 1, newLength = maxZ - minZ + 1;
+        if (newWidth == _tileGrid.GetWidth() && newHeight == _tileGrid.GetHeight() && newLength == _tileGrid.GetLength()) return;
+        _Execute(std::static_pointer_cast<Action>(
+            std::make_shared<ResizeAction>(*this, -(int)minX, -(int)minY, -(int)minZ, newWidth, newHeight, newLength)
+        ));
     }
 
     //Saves the map as a .te3 file at the given path. Returns false if there was an error.
-    bool SaveTE3Map(fs::path filePath);
+    //If `binary` is true, the file is written in the binary format instead of as JSON, which is smaller and faster to load.
+    bool SaveTE3Map(fs::path filePath, bool binary = false);
+
+    //Saves the map like above, but on another thread so that editing can continue in the meantime.
+    //The map is saved as it is at the time of the call, and the future gives the result once the file is written.
+    std::future<bool> SaveTE3MapAsync(fs::path filePath, bool binary = false);
 
-    //Loads a .te3 map from the given path. Returns false if there was an error.
+    //Loads a .te3 map from the given path, which may be in either format. Returns false if there was an error.
     bool LoadTE3Map(fs::path filePath);
 
     //Exports the map as a .gltf file, returning false on error.
     //If separateGeometry is true, then the geometry will be put into separate
     //GLTF nodes according to their tile shape and texture.
-    bool ExportGLTFScene(fs::path filePath, bool separateGeometry);
+    //If mergeFaces is true, then flat faces that line up are merged to reduce the number of triangles.
+    bool ExportGLTFScene(fs::path filePath, bool separateGeometry, bool mergeFaces);
 
     //Executes a undoable tile action for filling an area with one tile
     void ExecuteTileAction(size_t i, size_t j, size_t k, size_t w, size_t h, size_t l, Tile newTile);
@@ -213,11 +421,18 @@ public:
     //Executes an undoable entity action for removing an entity.
     void ExecuteEntRemoval(int i, int j, int k);
 
+    //Starts a stroke, during which all tile actions are combined into one so that they are undone together.
+    void BeginTileStroke();
+    //Finishes the current stroke, if there is one, and adds it to the undo history.
+    void EndTileStroke();
+
     inline void Undo()
     {
+        EndTileStroke();
         if (!_undoHistory.empty())
         {
             _undoHistory.back()->Undo(*this);
+            _undoHistoryBytes -= _undoHistory.back()->GetByteSize();
             _redoHistory.push_back(_undoHistory.back());
             _undoHistory.pop_back();
         }
@@ -225,15 +440,31 @@ public:
 
     inline void Redo()
     {
+        EndTileStroke();
         if (!_redoHistory.empty())
         {
             _redoHistory.back()->Do(*this);
+            _undoHistoryBytes += _redoHistory.back()->GetByteSize();
             _undoHistory.push_back(_redoHistory.back());
             _redoHistory.pop_back();
         }
     }
 private:
+    //Adds the action to the undo history and does it.
     void _Execute(std::shared_ptr<Action> action);
+    //Adds an action that has already been done to the undo history, forgetting old actions that go over the limits.
+    void _AddToHistory(std::shared_ptr<Action> action);
+    //Forgets all undo and redo actions, and deletes the spill file.
+    void _ClearHistory();
+    //Moves the data of the actions that are still in the history into a new spill file, leaving out that of forgotten actions.
+    void _CompactSpillFile();
+
+    //Saves the given grids as a .te3 file, reading nothing else from the map, so that it can be called with copies of them on another thread.
+    static bool _WriteTE3Map(fs::path filePath, bool binary, const TileGrid &tileGrid, const EntGrid &entGrid, const TilePalettePaths &palettePaths);
+    //Write the JSON and binary versions of the .te3 format. These may throw exceptions.
+    static void _WriteTE3Json(std::ostream &file, const TileGrid &tileGrid, const EntGrid &entGrid, const TilePalettePaths &palettePaths);
+    static void _WriteTE3Binary(std::ostream &file, const TileGrid &tileGrid, const EntGrid &entGrid, const TilePalettePaths &palettePaths);
+    bool _LoadTE3Binary(fs::path filePath);
 
     TileGrid _tileGrid;
     EntGrid _entGrid;
@@ -242,6 +473,14 @@ private:
     std::deque<std::shared_ptr<Action>> _undoHistory;
     //Stores recently undone actions to be redone on command, unless the history is altered.
     std::deque<std::shared_ptr<Action>> _redoHistory;
+    //Sum of the byte sizes of the actions in the undo history, kept up to date as actions are added, removed, and spilled.
+    size_t _undoHistoryBytes;
+    //Collects the tile actions of the stroke being made, or is null outside of strokes.
+    std::shared_ptr<TileAction> _tileStroke;
+    //Temporary file holding the data of actions that were spilled out of memory. Created on demand.
+    FILE *_spillFile;
+    size_t _spillFileBytes; //Size of the spill file
+    size_t _spilledBytes; //How much of the spill file belongs to actions that are still in the history
 };
 
 #endif
@@ -27,6 +27,10 @@
 #include "rlgl.h"
 #include "raymath.h"
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 const Vector3 VEC3_UP = (Vector3) { 0.0f, 1.0f, 0.0f };
 const Vector3 VEC3_FORWARD = (Vector3) { 0.0f, 0.0f, -1.0f };
 
@@ -72,6 +76,79 @@ inline Matrix MatrixRotYDeg(int degrees)
     return MatrixRotateY(ToRadians(degrees));
 }
 
+//Transforms an array of `count` vectors, stored as consecutive x, y, z values, by the matrix in one pass. `in` and `out` must not overlap.
+//When `translate` is false, the matrix's translation is left out, which is what normals and other directions need.
+inline void Vector3TransformArray(const float *in, float *out, int count, Matrix mat, bool translate)
+{
+    int v = 0;
+#ifdef __SSE__
+    const __m128 colX = _mm_setr_ps(mat.m0, mat.m1, mat.m2, 0.0f);
+    const __m128 colY = _mm_setr_ps(mat.m4, mat.m5, mat.m6, 0.0f);
+    const __m128 colZ = _mm_setr_ps(mat.m8, mat.m9, mat.m10, 0.0f);
+    const __m128 colW = translate ? _mm_setr_ps(mat.m12, mat.m13, mat.m14, 0.0f) : _mm_setzero_ps();
+    //Each vector is stored as four floats, with the extra one being overwritten by the next vector, so the last one is left to the scalar loop.
+    for (; v < count - 1; ++v)
+    {
+        const float *vec = in + (v * 3);
+        __m128 result = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(colX, _mm_set1_ps(vec[0])), _mm_mul_ps(colY, _mm_set1_ps(vec[1]))), 
+            _mm_add_ps(_mm_mul_ps(colZ, _mm_set1_ps(vec[2])), colW));
+        _mm_storeu_ps(out + (v * 3), result);
+    }
+#endif
+    const float tx = translate ? mat.m12 : 0.0f, ty = translate ? mat.m13 : 0.0f, tz = translate ? mat.m14 : 0.0f;
+    for (; v < count; ++v)
+    {
+        const float x = in[v*3], y = in[v*3 + 1], z = in[v*3 + 2];
+        out[v*3]     = ((mat.m0 * x) + (mat.m4 * y)) + ((mat.m8 * z) + tx);
+        out[v*3 + 1] = ((mat.m1 * x) + (mat.m5 * y)) + ((mat.m9 * z) + ty);
+        out[v*3 + 2] = ((mat.m2 * x) + (mat.m6 * y)) + ((mat.m10 * z) + tz);
+    }
+}
+
+//The planes bounding the region visible to a camera, each stored as a normal (x, y, z) and distance (w), with the normals facing inward.
+struct Frustum
+{
+    Vector4 planes[6];
+};
+
+//Extracts the frustum planes from a combined model-view-projection matrix.
+inline Frustum GetFrustumFromMatrix(Matrix mvp)
+{
+    //The rows of the matrix, when it is applied to column vectors like in Vector3Transform()
+    const Vector4 x = { mvp.m0, mvp.m4, mvp.m8, mvp.m12 };
+    const Vector4 y = { mvp.m1, mvp.m5, mvp.m9, mvp.m13 };
+    const Vector4 z = { mvp.m2, mvp.m6, mvp.m10, mvp.m14 };
+    const Vector4 w = { mvp.m3, mvp.m7, mvp.m11, mvp.m15 };
+
+    //A point is visible when -w <= x, y, z <= w in clip space, so each plane is w plus or minus one of the other rows.
+    return (Frustum) {
+        (Vector4) { w.x + x.x, w.y + x.y, w.z + x.z, w.w + x.w }, //Left
+        (Vector4) { w.x - x.x, w.y - x.y, w.z - x.z, w.w - x.w }, //Right
+        (Vector4) { w.x + y.x, w.y + y.y, w.z + y.z, w.w + y.w }, //Bottom
+        (Vector4) { w.x - y.x, w.y - y.y, w.z - y.z, w.w - y.w }, //Top
+        (Vector4) { w.x + z.x, w.y + z.y, w.z + z.z, w.w + z.w }, //Near
+        (Vector4) { w.x - z.x, w.y - z.y, w.z - z.z, w.w - z.w }, //Far
+    };
+}
+
+//Returns true if the box is entirely behind one of the frustum's planes, meaning that nothing inside of it can be seen.
+//Boxes that are outside of the frustum near one of its corners may not be detected, but this never gives false positives.
+inline bool IsBoxOutsideFrustum(const Frustum &frustum, BoundingBox box)
+{
+    for (const Vector4 &plane : frustum.planes)
+    {
+        //Test the corner of the box that is furthest along the plane's normal
+        Vector3 corner = {
+            plane.x >= 0.0f ? box.max.x : box.min.x,
+            plane.y >= 0.0f ? box.max.y : box.min.y,
+            plane.z >= 0.0f ? box.max.z : box.min.z,
+        };
+        if ((plane.x * corner.x) + (plane.y * corner.y) + (plane.z * corner.z) + plane.w < 0.0f) return true;
+    }
+    return false;
+}
+
 //Modified version of GetWorldToScreen(), but returns the NDC coordinates so that the program can tell what's behind the camera.
 inline Vector3 GetWorldToNDC(Vector3 position, Camera camera)
 {
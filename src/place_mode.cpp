@@ -73,6 +73,7 @@ void PlaceMode::OnEnter()
 
 void PlaceMode::OnExit() 
 {
+    _mapMan.EndTileStroke();
 }
 
 void PlaceMode::ResetCamera()
@@ -265,6 +266,12 @@ void PlaceMode::UpdateCursor()
             _cursor.tile.angle = _cursor.tile.pitch = 0;
         }
 
+        //Everything placed or removed while a mouse button is held is undone at once.
+        if ((IsMouseButtonPressed(MOUSE_BUTTON_LEFT) || IsMouseButtonPressed(MOUSE_BUTTON_RIGHT)) && !multiSelect)
+        {
+            _mapMan.BeginTileStroke();
+        }
+
         if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) && !multiSelect) 
         {
             //Place tiles
@@ -370,6 +377,11 @@ void PlaceMode::Update()
 {
     MoveCamera();
 
+    if (!IsMouseButtonDown(MOUSE_BUTTON_LEFT) && !IsMouseButtonDown(MOUSE_BUTTON_RIGHT))
+    {
+        _mapMan.EndTileStroke();
+    }
+
     if (!App::Get()->IsPreviewing())
     {    
         //Move editing plane
@@ -420,8 +432,11 @@ void PlaceMode::Update()
         //Undo and redo
         if (IsKeyDown(KEY_LEFT_CONTROL))
         {
+            const Vector3 mapSize = _mapMan.Tiles().GetMaxCorner();
             if (IsKeyPressed(KEY_Z)) _mapMan.Undo();
             else if (IsKeyPressed(KEY_Y)) _mapMan.Redo();
+            //Undoing and redoing resizes can leave the editing grid outside of the map.
+            if (!Vector3Equals(mapSize, _mapMan.Tiles().GetMaxCorner())) ResetGrid();
         }
     }
 }
@@ -20,50 +20,178 @@
 
 #include "tile.hpp"
 
+#include "rlgl.h"
 #include "cppcodec/base64_default_rfc4648.hpp"
 
 #include <assert.h>
 #include <iostream>
+#include <cstring>
+#include <sstream>
 #include <algorithm>
+#include <array>
+#include <tuple>
+#include <thread>
 
 #include "assets.hpp"
 #include "app.hpp"
 
-void TileGrid::_RegenBatches(Vector3 position, int fromY, int toY)
+Matrix TileGrid::_TileTransform(Vector3 position, int i, int j, int k, const Tile &tile) const
 {
-    _drawBatches.clear();
-    _batchFromY = fromY;
-    _batchToY = toY;
-    _batchPosition = position;
-    _regenBatches = false;
+    //Calculate world space matrix for the tile
+    Vector3 worldPos = Vector3Add(position, GridToWorldPos((Vector3) { (float)i, (float)j, (float)k }, true));
+    return MatrixMultiply(
+        TileRotationMatrix(tile), 
+        MatrixTranslate(worldPos.x, worldPos.y, worldPos.z));
+}
+
+void TileGrid::_BuildChunkBatches(size_t c, BatchChunk &out) const
+{
+    int i, j, k;
+    _ChunkCorner(c, i, j, k);
 
-    const size_t layerArea = _width * _length;
-    //Create a hash map of dynamic arrays for each combination of texture and mesh
-    for (int y = fromY; y <= toY; ++y)
+    //Empty the existing batches but keep their GPU buffers, since the same textures and shapes are likely to be used again.
+    for (auto &[pair, batch] : out.batches)
     {
-        for (size_t t = y * layerArea; t < (y + 1) * layerArea; ++t) {
-            const Tile& tile = _grid[t];
-            if (tile) {
-                //Calculate world space matrix for the tile
-                Vector3 gridPos = UnflattenIndex(t);
-                Vector3 worldPos = Vector3Add(position, GridToWorldPos(gridPos, true));
-                Matrix matrix = MatrixMultiply(
-                    TileRotationMatrix(tile), 
-                    MatrixTranslate(worldPos.x, worldPos.y, worldPos.z));
+        batch.instances.clear();
+        batch.uploaded = false;
+    }
+
+    for (int layer = 0; layer < GRID_CHUNK_SIZE; ++layer)
+    {
+        if (j + layer >= 0 && j + layer < (int)_height && GetLayerCount(j + layer) > 0)
+        {
+            ForEachOccupied(i, j + layer, k, GRID_CHUNK_SIZE, 1, GRID_CHUNK_SIZE, [&](int x, int y, int z, TileID id) {
+                const Tile &tile = _palette[id];
+                TileInstance instance(x - i, y - j, z - k, tile);
 
                 const Model &shape = Assets::ModelFromID(tile.shape);
                 for (size_t m = 0; m < shape.meshCount; ++m) {
-                    //Add the tile's transform to the instance arrays for each mesh
-                    auto pair = std::make_pair(tile.texture, &shape.meshes[m]);
-                    if (_drawBatches.find(pair) == _drawBatches.end()) {
-                        //Put in a vector for this pair if there hasn't been one already
-                        _drawBatches[pair] = std::vector<Matrix>();
-                    }
-                    _drawBatches[pair].push_back(matrix);
+                    //New batches start with all of their layer ends at zero, since the layers below had no instances in them
+                    out.batches[std::make_pair(tile.texture, &shape.meshes[m])].instances.push_back(instance);
                 }
-            }
+            });
+        }
+
+        //Close off this layer for every batch
+        for (auto &[pair, batch] : out.batches)
+        {
+            batch.layerEnds[layer] = batch.instances.size();
+        }
+    }
+
+    //Remove batches whose tiles have all been removed
+    for (auto iter = out.batches.begin(); iter != out.batches.end();)
+    {
+        if (iter->second.instances.empty())
+        {
+            if (iter->second.vboId != 0) rlUnloadVertexBuffer(iter->second.vboId);
+            iter = out.batches.erase(iter);
+        }
+        else
+        {
+            ++iter;
         }
     }
+    out.dirty = false;
+}
+
+void TileGrid::_RegenBatches()
+{
+    if (_batches.regenAll)
+    {
+        _batches.Clear();
+        _batches.chunks.assign(_chunks.size(), BatchChunk { {}, true });
+        _batches.regenAll = false;
+    }
+
+    for (size_t c = 0; c < _batches.chunks.size(); ++c)
+    {
+        if (_batches.chunks[c].dirty) _BuildChunkBatches(c, _batches.chunks[c]);
+    }
+}
+
+void TileGrid::BatchCache::Clear()
+{
+    for (BatchChunk &chunk : chunks)
+    {
+        for (auto &[pair, batch] : chunk.batches)
+        {
+            if (batch.vboId != 0) rlUnloadVertexBuffer(batch.vboId);
+        }
+    }
+    chunks.clear();
+    regenAll = true;
+}
+
+void TileGrid::_UploadBatch(LayeredBatch &batch)
+{
+    if (batch.uploaded) return;
+
+    const int dataSize = batch.instances.size() * sizeof(TileInstance);
+    if (batch.vboId != 0 && batch.vboCapacity >= batch.instances.size())
+    {
+        rlUpdateVertexBuffer(batch.vboId, batch.instances.data(), dataSize, 0);
+    }
+    else
+    {
+        //Reallocate the buffer when it's too small
+        if (batch.vboId != 0) rlUnloadVertexBuffer(batch.vboId);
+        batch.vboId = rlLoadVertexBuffer(batch.instances.data(), dataSize, true);
+        batch.vboCapacity = batch.instances.size();
+    }
+    _batches.bytesUploaded += dataSize;
+    batch.uploaded = true;
+
+    //The GPU has its own copy now, and the layer ends still record how many instances there are
+    std::vector<TileInstance>().swap(batch.instances);
+}
+
+//Draws `count` instances of the mesh using the instanced map shader, which places each one using the TileInstance data along with the chunk's offset.
+//The instances are read from the GPU buffer `instancesVboId`, starting at index `first`.
+//This is DrawMeshInstanced() with the instance transforms replaced by TileInstances.
+static void DrawTileInstances(const Mesh &mesh, const Material &material, unsigned int instancesVboId, int first, int count, Vector3 chunkOffset, float spacing)
+{
+    const int *locs = material.shader.locs;
+    rlEnableShader(material.shader.id);
+
+    if (locs[SHADER_LOC_COLOR_DIFFUSE] != -1)
+    {
+        const Color &color = material.maps[MATERIAL_MAP_DIFFUSE].color;
+        float values[4] = { (float)color.r/255.0f, (float)color.g/255.0f, (float)color.b/255.0f, (float)color.a/255.0f };
+        rlSetUniform(locs[SHADER_LOC_COLOR_DIFFUSE], values, SHADER_UNIFORM_VEC4, 1);
+    }
+    rlSetUniform(locs[MAP_SHADER_LOC_CHUNK_OFFSET], &chunkOffset, SHADER_UNIFORM_VEC3, 1);
+    rlSetUniform(locs[MAP_SHADER_LOC_GRID_SPACING], &spacing, SHADER_UNIFORM_FLOAT, 1);
+
+    Matrix matModelView = MatrixMultiply(rlGetMatrixTransform(), rlGetMatrixModelview());
+    rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_MVP], MatrixMultiply(matModelView, rlGetMatrixProjection()));
+
+    int textureSlot = 0;
+    rlActiveTextureSlot(textureSlot);
+    rlEnableTexture(material.maps[MATERIAL_MAP_DIFFUSE].texture.id);
+    rlSetUniform(locs[SHADER_LOC_MAP_DIFFUSE], &textureSlot, SHADER_UNIFORM_INT, 1);
+
+    //The map shader requires GLSL 330, so vertex arrays are always available.
+    rlEnableVertexArray(mesh.vaoId);
+
+    //Attach the instance data to the mesh's vertex array, as bytes converted to floats.
+    rlEnableVertexBuffer(instancesVboId);
+    rlEnableVertexAttribute(locs[SHADER_LOC_MATRIX_MODEL]);
+    rlSetVertexAttribute(locs[SHADER_LOC_MATRIX_MODEL], 4, RL_UNSIGNED_BYTE, false, sizeof(TileInstance), (void *)(first * sizeof(TileInstance)));
+    rlSetVertexAttributeDivisor(locs[SHADER_LOC_MATRIX_MODEL], 1);
+
+    if (mesh.indices != NULL) rlDrawVertexArrayElementsInstanced(0, mesh.triangleCount * 3, 0, count);
+    else rlDrawVertexArrayInstanced(0, mesh.vertexCount, count);
+
+    //Detach the instance data, so that the non-instanced shader can still draw the mesh
+    rlDisableVertexAttribute(locs[SHADER_LOC_MATRIX_MODEL]);
+    rlDisableVertexArray();
+    rlDisableVertexBuffer();
+    rlDisableVertexBufferElement();
+
+    rlActiveTextureSlot(textureSlot);
+    rlDisableTexture();
+    rlDisableShader();
 }
 
 void TileGrid::Draw(Vector3 position)
@@ -73,81 +201,502 @@ void TileGrid::Draw(Vector3 position)
 
 void TileGrid::Draw(Vector3 position, int fromY, int toY)
 {
+    _drawStats = {};
+    const Frustum frustum = GetFrustumFromMatrix(
+        MatrixMultiply(MatrixMultiply(rlGetMatrixTransform(), rlGetMatrixModelview()), rlGetMatrixProjection()));
+
     if (App::Get()->IsPreviewing())
     {
-        DrawModel(GetModel(), position, 1.0f, WHITE);
+        _RegenPreview();
+
+        for (size_t c = 0; c < _preview.chunks.size(); ++c)
+        {
+            const Model *model = _preview.chunks[c].model;
+            if (model == nullptr) continue;
+            _drawStats.chunksTotal += 1;
+
+            int chunkX, chunkY, chunkZ;
+            _ChunkCorner(c, chunkX, chunkY, chunkZ);
+            const BoundingBox bounds = {
+                Vector3Add(position, GridToWorldPos((Vector3) { (float)Max(chunkX, 0), (float)Max(chunkY, 0), (float)Max(chunkZ, 0) }, false)),
+                Vector3Add(position, GridToWorldPos((Vector3) { 
+                    (float)Min(chunkX + GRID_CHUNK_SIZE, _width), 
+                    (float)Min(chunkY + GRID_CHUNK_SIZE, _height), 
+                    (float)Min(chunkZ + GRID_CHUNK_SIZE, _length) }, false)),
+            };
+            if (IsBoxOutsideFrustum(frustum, bounds)) continue;
+            _drawStats.chunksDrawn += 1;
+
+            DrawModel(*model, position, 1.0f, WHITE);
+        }
     }
     else
     {
-        if (_regenBatches || fromY != _batchFromY || toY != _batchToY || !Vector3Equals(position, _batchPosition))
+        _RegenBatches();
+
+        //Draw the instances for each combination of material and mesh, on the range of each chunk's instances that are in visible layers.
+        for (size_t c = 0; c < _batches.chunks.size(); ++c)
         {
-            _RegenBatches(position, fromY, toY);
-        }
+            int chunkX, chunkY, chunkZ;
+            _ChunkCorner(c, chunkX, chunkY, chunkZ);
+            const int firstLayer = Max(fromY - chunkY, 0);
+            const int lastLayer = Min(toY - chunkY, GRID_CHUNK_SIZE - 1);
+            if (firstLayer > lastLayer) continue;
+
+            size_t instanceCount = 0;
+            for (const auto& [pair, batch] : _batches.chunks[c].batches) {
+                instanceCount += batch.layerEnds[lastLayer] - ((firstLayer > 0) ? batch.layerEnds[firstLayer - 1] : 0);
+            }
+            if (instanceCount == 0) continue;
+            _drawStats.chunksTotal += 1;
+            _drawStats.instancesTotal += instanceCount;
+
+            //Skip chunks whose visible layers are out of the camera's view
+            const BoundingBox bounds = {
+                Vector3Add(position, GridToWorldPos((Vector3) { (float)Max(chunkX, 0), (float)(chunkY + firstLayer), (float)Max(chunkZ, 0) }, false)),
+                Vector3Add(position, GridToWorldPos((Vector3) { 
+                    (float)Min(chunkX + GRID_CHUNK_SIZE, _width), 
+                    (float)(chunkY + lastLayer + 1), 
+                    (float)Min(chunkZ + GRID_CHUNK_SIZE, _length) }, false)),
+            };
+            if (IsBoxOutsideFrustum(frustum, bounds)) continue;
+            _drawStats.chunksDrawn += 1;
+            _drawStats.instancesDrawn += instanceCount;
 
-        //Call DrawMeshInstanced for each combination of material and mesh.
-        for (auto& [pair, matrices] : _drawBatches) {
-            DrawMeshInstanced(*pair.second, Assets::GetMaterialForTexture(pair.first, true), matrices.data(), matrices.size());
+            const Vector3 chunkOffset = Vector3Add(position, GridToWorldPos((Vector3) { (float)chunkX, (float)chunkY, (float)chunkZ }, true));
+            for (auto& [pair, batch] : _batches.chunks[c].batches) {
+                size_t begin = (firstLayer > 0) ? batch.layerEnds[firstLayer - 1] : 0;
+                size_t end = batch.layerEnds[lastLayer];
+                if (end > begin)
+                {
+                    _UploadBatch(batch);
+                    DrawTileInstances(*pair.second, Assets::GetMaterialForTexture(pair.first, true), 
+                        batch.vboId, begin, end - begin, chunkOffset, _spacing);
+                }
+            }
         }
     }
 }
 
 std::string TileGrid::GetTileDataBase64(const std::set<fs::path> &usedTextures, const std::set<fs::path> &usedShapes) const 
 {
-    std::vector<fs::path> textures;
-    std::vector<fs::path> shapes;
+    std::ostringstream out;
+    WriteTileDataBase64(out, usedTextures, usedShapes, GetPalettePaths());
+    return out.str();
+}
+
+//A run of identical tiles in the compressed tile data.
+struct TileRun
+{
+    uint32_t count;
+    Tile tile;
+};
+
+static_assert(sizeof(TileRun) == 20, "Tile runs are saved as they are laid out in memory.");
+
+void TileGrid::WriteTileDataBase64(std::ostream &out, const std::set<fs::path> &usedTextures, const std::set<fs::path> &usedShapes, const TilePalettePaths &palettePaths) const
+{
+    std::map<fs::path, int> textureIndices, shapeIndices;
+    for (const fs::path &p : usedTextures) textureIndices.emplace(p, (int)textureIndices.size());
+    for (const fs::path &p : usedShapes) shapeIndices.emplace(p, (int)shapeIndices.size());
 
-    for (const fs::path &p : usedTextures) textures.push_back(p);
-    for (const fs::path &p : usedShapes) shapes.push_back(p);
+    //Change the texture and shape IDs of each unique tile to index into the given two sets, so that it only has to be done once per palette entry.
+    std::vector<Tile> savedPalette = _palette;
+    for (size_t id = 0; id < savedPalette.size(); ++id)
+    {
+        Tile &tile = savedPalette[id];
+        if (!tile) continue;
+        auto texIter = textureIndices.find(palettePaths.textures[id]);
+        if (texIter != textureIndices.end()) tile.texture = texIter->second;
+        auto shapeIter = shapeIndices.find(palettePaths.shapes[id]);
+        if (shapeIter != shapeIndices.end()) tile.shape = shapeIter->second;
+    }
 
+    //Base 64 turns every 3 bytes into 4 characters, so pieces whose sizes are multiples of 3 can be encoded separately without padding in between.
     std::vector<uint8_t> bin;
-    bin.reserve(_grid.size() * sizeof(Tile));
-    for (size_t i = 0; i < _grid.size(); ++i)
+    auto encodeBin = [&]() {
+        const size_t encodeSize = bin.size() - (bin.size() % 3);
+        out << base64::encode(bin.data(), encodeSize);
+        bin.erase(bin.begin(), bin.begin() + encodeSize);
+    };
+
+    //Runs of identical tiles are gathered into blocks, and each block is compressed on its own so that only one is in memory at a time.
+    std::vector<TileRun> runs;
+    runs.reserve(TILE_DATA_BLOCK_RUNS);
+    auto compressRuns = [&]() {
+        int compSize = 0;
+        unsigned char *compData = CompressData(reinterpret_cast<const unsigned char *>(runs.data()), (int)(runs.size() * sizeof(TileRun)), &compSize);
+        if (!compData) throw std::runtime_error("Failed to compress tile data.");
+        const uint32_t blockSize = (uint32_t)compSize;
+        bin.insert(bin.end(), reinterpret_cast<const uint8_t *>(&blockSize), reinterpret_cast<const uint8_t *>(&blockSize) + sizeof(blockSize));
+        bin.insert(bin.end(), compData, compData + compSize);
+        MemFree(compData);
+        runs.clear();
+        encodeBin();
+    };
+
+    std::vector<TileID> row(_width);
+    TileID runID = 0;
+    uint32_t runCount = 0;
+    for (int y = 0; y < (int)_height; ++y)
     {
-        Tile savedTile = _grid[i];
+        for (int z = 0; z < (int)_length; ++z)
+        {
+            GetCelRow(y, z, row.data());
+            for (TileID id : row)
+            {
+                if (id == runID && runCount < UINT32_MAX)
+                {
+                    ++runCount;
+                    continue;
+                }
+                if (runCount > 0) runs.push_back({ runCount, savedPalette[runID] });
+                if (runs.size() == TILE_DATA_BLOCK_RUNS) compressRuns();
+                runID = id;
+                runCount = 1;
+            }
+        }
+    }
+    if (runCount > 0) runs.push_back({ runCount, savedPalette[runID] });
+    if (!runs.empty()) compressRuns();
+    out << base64::encode(bin);
+}
 
-        if (savedTile)
+void TileGrid::SetTileDataBase64(std::string data, int version)
+{
+    //Tiles are placed into the grid a row at a time as they are decoded.
+    //The palette isn't compacted along the way, since that would lose the IDs in the row that hasn't been placed yet.
+    std::vector<TileID> row(_width);
+    int x = 0, y = 0, z = 0;
+    auto place = [&](TileID id, size_t count) {
+        while (count > 0 && y < (int)_height)
+        {
+            const int n = (int)std::min(count, (size_t)(_width - x));
+            std::fill_n(&row[x], n, id);
+            x += n;
+            count -= n;
+            if (x < (int)_width) continue;
+            SetCelRow(y, z, row.data());
+            x = 0;
+            if (++z == (int)_length)
+            {
+                z = 0;
+                ++y;
+            }
+        }
+    };
+
+    if (version == TILE_DATA_VERSION_RLE)
+    {
+        //The compressed data is small, so it is decoded all at once. Then each block of runs is decompressed in turn.
+        std::vector<uint8_t> bin = base64::decode(data);
+        //Check that the size prefixes of all of the blocks fit in the data before any tiles are placed.
+        for (size_t pos = 0; pos < bin.size();)
+        {
+            uint32_t blockSize = 0;
+            if (bin.size() - pos < sizeof(blockSize)) throw std::runtime_error("Tile data is cut off.");
+            memcpy(&blockSize, &bin[pos], sizeof(blockSize));
+            pos += sizeof(blockSize);
+            if (bin.size() - pos < blockSize) throw std::runtime_error("Tile data is cut off.");
+            pos += blockSize;
+        }
+        for (size_t pos = 0; pos < bin.size() && y < (int)_height;)
         {
-            //Change the texture and shape IDs to index into the given two arrays.
-            fs::path tPath = Assets::PathFromTexID(savedTile.texture);
-            fs::path sPath = Assets::PathFromModelID(savedTile.shape);
-            for (int i = 0; i < textures.size(); ++i)
+            uint32_t blockSize = 0;
+            memcpy(&blockSize, &bin[pos], sizeof(blockSize));
+            pos += sizeof(blockSize);
+
+            int runBytes = 0;
+            unsigned char *runData = DecompressData(&bin[pos], (int)blockSize, &runBytes);
+            if (!runData) throw std::runtime_error("Failed to decompress tile data.");
+            try
+            {
+                for (int r = 0; r + (int)sizeof(TileRun) <= runBytes && y < (int)_height; r += sizeof(TileRun))
+                {
+                    TileRun run;
+                    memcpy(&run, &runData[r], sizeof(TileRun));
+                    place(_PaletteIndex(run.tile, false), run.count);
+                }
+            }
+            catch (...)
             {
-                if (textures[i] == tPath) savedTile.texture = i;
+                //Running out of room in the palette throws
+                MemFree(runData);
+                throw;
             }
-            for (int i = 0; i < shapes.size(); ++i)
+            MemFree(runData);
+            pos += blockSize;
+        }
+    }
+    else if (version == TILE_DATA_VERSION_RAW)
+    {
+        //Decode blocks of whole 4 character groups at a time, so that the decoded data is never all in memory at once.
+        //Each block decodes into a whole number of tiles.
+        constexpr size_t BLOCK_CHARS = 4 * 64 * 1024;
+        static_assert((BLOCK_CHARS / 4 * 3) % sizeof(Tile) == 0);
+        std::vector<uint8_t> bin(base64::decoded_max_size(BLOCK_CHARS));
+        for (size_t pos = 0; pos < data.size() && y < (int)_height; pos += BLOCK_CHARS)
+        {
+            const size_t binSize = base64::decode(bin.data(), bin.size(), data.data() + pos, std::min(BLOCK_CHARS, data.size() - pos));
+            for (size_t i = 0; i + sizeof(Tile) <= binSize && y < (int)_height; i += sizeof(Tile))
             {
-                if (shapes[i] == sPath) savedTile.shape = i;
+                //Reinterpret groups of bytes as tiles and place them into the grid.
+                Tile tile;
+                memcpy(&tile, &bin[i], sizeof(Tile));
+                place(_PaletteIndex(tile, false), 1);
             }
         }
+    }
+    else
+    {
+        throw std::runtime_error("Unsupported tile data version.");
+    }
+
+    //Place what there is of the last row if the data ends partway through it.
+    for (int i = 0; i < x; ++i) SetCel(i, y, z, row[i]);
+}
+
+void TileGrid::GetTileDataBinary(const std::vector<fs::path> &textures, const std::vector<fs::path> &shapes, const TilePalettePaths &palettePaths, 
+    std::vector<Tile> &palette, std::vector<TileID> &cels) const
+{
+    std::map<fs::path, int> textureIndices, shapeIndices;
+    for (size_t i = 0; i < textures.size(); ++i) textureIndices[textures[i]] = (int)i;
+    for (size_t i = 0; i < shapes.size(); ++i) shapeIndices[shapes[i]] = (int)i;
+
+    //Leave out the palette entries that aren't used anymore.
+    std::vector<bool> used = _GetUsedPaletteEntries();
+    std::vector<TileID> remapped(_palette.size(), 0);
+    palette.assign(1, Tile());
+    for (size_t id = 1; id < _palette.size(); ++id)
+    {
+        if (!used[id]) continue;
+        remapped[id] = (TileID)palette.size();
+        Tile tile = _palette[id];
+        tile.texture = textureIndices.at(palettePaths.textures[id]);
+        tile.shape = shapeIndices.at(palettePaths.shapes[id]);
+        palette.push_back(tile);
+    }
+
+    cels.resize(_width * _height * _length);
+    GetCelsFlat(cels.data());
+    for (TileID &id : cels) id = remapped[id];
+}
+
+void TileGrid::SetTileDataBinary(const std::vector<Tile> &palette, const TileID *cels)
+{
+    assert(!palette.empty() && !palette[0]);
+    _palette = palette;
+    _paletteLookup.clear();
+    for (size_t id = 0; id < _palette.size(); ++id) _paletteLookup.try_emplace(_palette[id], (TileID)id);
+
+    SetCelsFlat(cels);
+    _MarkDirty(0, 0, 0, _width, _height, _length);
+}
+
+void TileGrid::_CompactPalette()
+{
+    std::vector<bool> used = _GetUsedPaletteEntries();
+    used[0] = true;
+    used[_fill] = true;
+
+    std::vector<TileID> remapped(_palette.size(), 0);
+    std::vector<Tile> newPalette;
+    _paletteLookup.clear();
+    for (size_t id = 0; id < _palette.size(); ++id)
+    {
+        if (!used[id]) continue;
+        remapped[id] = (TileID)newPalette.size();
+        _paletteLookup[_palette[id]] = remapped[id];
+        newPalette.push_back(_palette[id]);
+    }
+
+    for (size_t c = 0; c < _chunks.size(); ++c)
+    {
+        if (!_chunks[c]) continue;
+        Chunk &chunk = _MutableChunk(c);
+        for (size_t t = 0; t < CHUNK_VOLUME; ++t) chunk.cels[t] = remapped[chunk.cels[t]];
+    }
+    _fill = remapped[_fill];
+    _palette = newPalette;
+}
+
+//Cel sides in the order +X, -X, +Y, -Y, +Z, -Z, so that the opposite of side `s` is `s ^ 1`.
+static const int CEL_SIDE_OFFSETS[6][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+
+//Returns the side of a cel that the triangle lies flat against, or -1 if there isn't one.
+//The vertices are relative to the center of the cel.
+static int GetTriangleSide(Vector3 a, Vector3 b, Vector3 c, float halfSize)
+{
+    const float TOLERANCE = 0.001f;
+    const Vector3 verts[3] = { a, b, c };
+    for (int s = 0; s < 6; ++s)
+    {
+        const Vector3 normal = { (float)CEL_SIDE_OFFSETS[s][0], (float)CEL_SIDE_OFFSETS[s][1], (float)CEL_SIDE_OFFSETS[s][2] };
+        bool onSide = true;
+        for (int v = 0; v < 3 && onSide; ++v)
+        {
+            onSide = fabsf(Vector3DotProduct(verts[v], normal) - halfSize) < TOLERANCE;
+        }
+        if (onSide) return s;
+    }
+    return -1;
+}
+
+//Returns the index of the mesh's vertex that makes up corner `c` of triangle `t`.
+static inline int GetTriangleVertex(const Mesh &mesh, int t, int c)
+{
+    return (mesh.indices != NULL) ? mesh.indices[(t * 3) + c] : (t * 3) + c;
+}
 
-        //Reinterpret each tile as a series of bytes and push them onto the vector.
-        const char *tileBin = reinterpret_cast<const char *>(&savedTile);
-        for (size_t b = 0; b < sizeof(Tile); ++b)
+static inline Vector3 GetMeshVertex(const Mesh &mesh, int v)
+{
+    return (Vector3) { mesh.vertices[v*3], mesh.vertices[v*3 + 1], mesh.vertices[v*3 + 2] };
+}
+
+//Returns a bit for each side of a cel that the shape completely covers when rotated by `rotation`.
+static uint8_t GetCoveredSides(const Model &shape, Matrix rotation, float halfSize)
+{
+    float areas[6] = { 0 };
+    for (int m = 0; m < shape.meshCount; ++m)
+    {
+        const Mesh &mesh = shape.meshes[m];
+        if (mesh.vertices == NULL) continue;
+        for (int t = 0; t < mesh.triangleCount; ++t)
         {
-            bin.push_back(tileBin[b]);
+            Vector3 a = Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 0)), rotation);
+            Vector3 b = Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 1)), rotation);
+            Vector3 c = Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 2)), rotation);
+            int side = GetTriangleSide(a, b, c, halfSize);
+            if (side < 0) continue;
+
+            //Only count triangles facing out of the cel, so that double sided faces aren't counted twice
+            Vector3 cross = Vector3CrossProduct(Vector3Subtract(b, a), Vector3Subtract(c, a));
+            const Vector3 normal = { (float)CEL_SIDE_OFFSETS[side][0], (float)CEL_SIDE_OFFSETS[side][1], (float)CEL_SIDE_OFFSETS[side][2] };
+            if (Vector3DotProduct(cross, normal) > 0.0f) areas[side] += Vector3Length(cross) / 2.0f;
         }
     }
 
-    return base64::encode(bin);
+    uint8_t covered = 0;
+    const float SIDE_AREA = 4.0f * halfSize * halfSize;
+    for (int s = 0; s < 6; ++s)
+    {
+        if (areas[s] >= SIDE_AREA * 0.999f) covered |= (1 << s);
+    }
+    return covered;
 }
 
-void TileGrid::SetTileDataBase64(std::string data)
+//Returns the coordinates of `v` along the two axes that lie along the given side of a cel.
+static inline Vector2 GetSideCoords(Vector3 v, int side)
 {
-    std::vector<uint8_t> bin = base64::decode(data);
-    for (size_t i = 0; i < bin.size() / sizeof(Tile) && i < _grid.size(); ++i)
+    switch (side / 2)
     {
-        //Reinterpret groups of bytes as tiles and place them into the grid.
-        _grid[i] = *(reinterpret_cast<Tile *>(&bin[i * sizeof(Tile)]));
+    case 0: return (Vector2) { v.y, v.z };
+    case 1: return (Vector2) { v.x, v.z };
+    default: return (Vector2) { v.x, v.y };
     }
-    std::cout << std::endl;
 }
 
-#define MAX_MATERIAL_MAPS 12
-Model *TileGrid::_GenerateModel()
+//A mesh's face that covers one whole side of its cel, with its texture coordinates laid out so that it can be merged with matching faces of neighboring tiles.
+struct SideFace
 {
-    _RegenBatches(Vector3Zero(), 0, _height - 1);
+    bool mergeable;
+    int uvAxes[2][2]; //The change in texture coordinates for each cel moved along the side's two axes
+    Vector2 uvCenter; //The texture coordinates at the center of the side
+};
+
+//Finds the faces of the mesh that can be merged on each side of the cel, after it is rotated by `rotation`.
+static void GetSideFaces(const Mesh &mesh, Matrix rotation, float spacing, SideFace faces[6])
+{
+    const float TOLERANCE = 0.001f;
+    const float halfSize = spacing / 2.0f;
+    for (int s = 0; s < 6; ++s) faces[s] = (SideFace) { 0 };
+    if (mesh.vertices == NULL || mesh.texcoords == NULL || mesh.normals == NULL) return;
+
+    //Group the mesh's triangles by side
+    std::vector<int> sideTris[6];
+    for (int t = 0; t < mesh.triangleCount; ++t)
+    {
+        int side = GetTriangleSide(
+            Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 0)), rotation),
+            Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 1)), rotation),
+            Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 2)), rotation),
+            halfSize);
+        if (side >= 0) sideTris[side].push_back(t);
+    }
 
-    std::set<TexID> usedTexIDs;
+    for (int s = 0; s < 6; ++s)
+    {
+        if (sideTris[s].empty()) continue;
+        const Vector3 normal = { (float)CEL_SIDE_OFFSETS[s][0], (float)CEL_SIDE_OFFSETS[s][1], (float)CEL_SIDE_OFFSETS[s][2] };
+
+        //Fit the texture coordinates to a linear function of the position on the side, based on the first triangle.
+        Vector2 pos[3], uv[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            int v = GetTriangleVertex(mesh, sideTris[s][0], c);
+            pos[c] = Vector2Scale(GetSideCoords(Vector3Transform(GetMeshVertex(mesh, v), rotation), s), 1.0f / spacing);
+            uv[c] = (Vector2) { mesh.texcoords[v*2], mesh.texcoords[v*2 + 1] };
+        }
+        const Vector2 e1 = Vector2Subtract(pos[1], pos[0]), e2 = Vector2Subtract(pos[2], pos[0]);
+        const Vector2 d1 = Vector2Subtract(uv[1], uv[0]), d2 = Vector2Subtract(uv[2], uv[0]);
+        const float det = (e1.x * e2.y) - (e1.y * e2.x);
+        if (fabsf(det) < TOLERANCE) continue;
+        const Vector2 axisA = Vector2Scale(Vector2Subtract(Vector2Scale(d1, e2.y), Vector2Scale(d2, e1.y)), 1.0f / det);
+        const Vector2 axisB = Vector2Scale(Vector2Subtract(Vector2Scale(d2, e1.x), Vector2Scale(d1, e2.x)), 1.0f / det);
+        const Vector2 uvCenter = Vector2Subtract(uv[0], Vector2Add(Vector2Scale(axisA, pos[0].x), Vector2Scale(axisB, pos[0].y)));
+
+        //The texture must repeat exactly once per cel for the faces to be merged without changing how it looks
+        const float axes[4] = { axisA.x, axisA.y, axisB.x, axisB.y };
+        bool mergeable = true;
+        for (int a = 0; a < 4; ++a)
+        {
+            if (fabsf(axes[a] - roundf(axes[a])) > TOLERANCE) mergeable = false;
+        }
+
+        //Every triangle on the side must face outward, be flat shaded, use plain vertex colors, and follow the same texture mapping.
+        float area = 0.0f;
+        for (int t : sideTris[s])
+        {
+            if (!mergeable) break;
+            Vector3 verts[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                int v = GetTriangleVertex(mesh, t, c);
+                verts[c] = Vector3Transform(GetMeshVertex(mesh, v), rotation);
+
+                Vector3 norm = Vector3Transform((Vector3) { mesh.normals[v*3], mesh.normals[v*3 + 1], mesh.normals[v*3 + 2] }, rotation);
+                if (Vector3Length(Vector3Subtract(Vector3Normalize(norm), normal)) > TOLERANCE) mergeable = false;
+
+                if (mesh.colors != NULL && (mesh.colors[v*4] != 255 || mesh.colors[v*4 + 1] != 255 || mesh.colors[v*4 + 2] != 255 || mesh.colors[v*4 + 3] != 255))
+                {
+                    mergeable = false;
+                }
+
+                Vector2 coords = Vector2Scale(GetSideCoords(verts[c], s), 1.0f / spacing);
+                Vector2 expected = Vector2Add(uvCenter, Vector2Add(Vector2Scale(axisA, coords.x), Vector2Scale(axisB, coords.y)));
+                if (Vector2Distance(expected, (Vector2) { mesh.texcoords[v*2], mesh.texcoords[v*2 + 1] }) > TOLERANCE) mergeable = false;
+            }
+
+            Vector3 cross = Vector3CrossProduct(Vector3Subtract(verts[1], verts[0]), Vector3Subtract(verts[2], verts[0]));
+            if (Vector3DotProduct(cross, normal) <= 0.0f) mergeable = false;
+            area += Vector3Length(cross) / 2.0f;
+        }
+        if (!mergeable || fabsf(area - (spacing * spacing)) > TOLERANCE) continue;
+
+        faces[s].mergeable = true;
+        faces[s].uvAxes[0][0] = (int)roundf(axisA.x);
+        faces[s].uvAxes[0][1] = (int)roundf(axisA.y);
+        faces[s].uvAxes[1][0] = (int)roundf(axisB.x);
+        faces[s].uvAxes[1][1] = (int)roundf(axisB.y);
+        faces[s].uvCenter = uvCenter;
+    }
+}
+
+#define MAX_MATERIAL_MAPS 12
+//Raylib's meshes use 16 bit indices, so no more than this many vertices can be put into each one.
+#define MODEL_MESH_MAX_VERTICES 65536
+std::vector<Model *> TileGrid::_GenerateModels(bool mergeFaces, const std::vector<size_t> &chunks, bool modelPerChunk)
+{
     struct DynMesh {
         std::vector<float> positions;
         std::vector<float> texCoords;
@@ -155,158 +704,490 @@ Model *TileGrid::_GenerateModel()
         std::vector<unsigned char> colors;
         std::vector<unsigned short> indices;
         int triCount; //Independent form indices count since some models may not have indices
+        bool indexed; //Whether the triangles are made with `indices` or from consecutive vertices
+    };
+
+    //Faces that cover a whole side of a cel are collected instead, so that ones on the same plane with the same texture and texture mapping can be merged.
+    //They are grouped by texture, side, plane, texture mapping (with the whole number part of the coordinates dropped), and whether vertex colors are used.
+    //The fractional part of the texture coordinates is rounded for grouping, but the merged faces are given the exact value of one of the group's faces.
+    typedef std::tuple<TexID, int, int, int, int, int, int, int, int, bool> FaceGroupKey;
+    struct FaceGroup {
+        std::set<std::pair<int, int>> cels; //The cels of the faces in the group, row first
+        Vector2 uvFraction; //The fractional part of the texture coordinates at the center of the first face's side
+    };
+    typedef std::map<FaceGroupKey, FaceGroup> FaceGroupMap;
+
+    //The geometry is generated by several threads at once, each putting what it makes into parts that no other thread uses, and then the parts are joined in order.
+    //Each texture's geometry is split into as many meshes as it takes to keep the vertex count within the range of the 16 bit indices.
+    struct ModelPart {
+        std::map<TexID, std::vector<DynMesh>> meshMap;
+        FaceGroupMap faceGroups;
+        std::vector<float> shapePositions, shapeNormals; //The vertices of the current tile's shape, transformed into place
+
+        DynMesh &GetMesh(TexID texID, int vertexCount, bool indexed)
+        {
+            std::vector<DynMesh> &pieces = meshMap[texID];
+            if (pieces.empty() || pieces.back().indexed != indexed || (pieces.back().positions.size() / 3) + vertexCount > MODEL_MESH_MAX_VERTICES)
+            {
+                pieces.push_back((DynMesh) {});
+                pieces.back().triCount = 0;
+                pieces.back().indexed = indexed;
+            }
+            return pieces.back();
+        }
+    };
+
+    //Calls `fn(first, end, thread)` on a range of [0, count) for each thread, and waits for all of them to finish.
+    //Starting threads costs more than small amounts of work do, so each thread is given at least `minPerThread` items,
+    //and editing a few tiles, which only regenerates the preview of a few chunks, runs everything on the calling thread.
+    const size_t threadCount = Max(1, (int)std::thread::hardware_concurrency());
+    auto runThreads = [threadCount](size_t count, size_t minPerThread, auto fn) {
+        const size_t usedThreads = Max(1, Min((int)threadCount, (int)(count / minPerThread)));
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < usedThreads; ++t)
+        {
+            threads.emplace_back(fn, (t * count) / usedThreads, ((t + 1) * count) / usedThreads, t);
+        }
+        fn(0, count / usedThreads, 0);
+        for (std::thread &thread : threads) thread.join();
     };
-    std::map<TexID, DynMesh> meshMap;
 
-    for (const auto& [pair, matrices] : _drawBatches)
+    //Everything that the threads need to know about each palette entry is calculated beforehand, so that they only read shared data.
+    //Faces pressed against a side of a neighboring tile that is completely covered can never be seen, so they are left out.
+    const float halfSize = _spacing / 2.0f;
+    std::vector<const Model *> paletteShapes(_palette.size(), nullptr);
+    std::vector<int> paletteCoveredSides(_palette.size(), 0);
+    std::vector<std::vector<std::array<SideFace, 6>>> paletteSideFaces(_palette.size()); //Calculated for each mesh of each palette entry
+    //The cel side that each triangle of each mesh lies on and faces out of, or -1. Triangles facing into the cel, like the back of a double sided panel, 
+    //can still be seen from inside of it when the side is covered, so they aren't given a side.
+    std::vector<std::vector<std::vector<int8_t>>> paletteTriangleSides(_palette.size());
+    for (size_t id = 0; id < _palette.size(); ++id)
     {
-        auto [iter, succ] = usedTexIDs.insert(pair.first);
-        if (succ)
+        const Tile &tile = _palette[id];
+        paletteShapes[id] = &Assets::ModelFromID(tile.shape);
+        paletteTriangleSides[id].resize(paletteShapes[id]->meshCount);
+        for (int m = 0; m < paletteShapes[id]->meshCount; ++m)
         {
-            meshMap[pair.first] = (DynMesh) {};
-            meshMap[pair.first].triCount = 0;
+            const Mesh &mesh = paletteShapes[id]->meshes[m];
+            if (mesh.vertices == NULL) continue;
+            const Matrix rotation = TileRotationMatrix(tile);
+            for (int t = 0; t < mesh.triangleCount; ++t)
+            {
+                const Vector3 a = Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 0)), rotation);
+                const Vector3 b = Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 1)), rotation);
+                const Vector3 c = Vector3Transform(GetMeshVertex(mesh, GetTriangleVertex(mesh, t, 2)), rotation);
+                int side = GetTriangleSide(a, b, c, halfSize);
+                if (side >= 0)
+                {
+                    const Vector3 cross = Vector3CrossProduct(Vector3Subtract(b, a), Vector3Subtract(c, a));
+                    const Vector3 normal = { (float)CEL_SIDE_OFFSETS[side][0], (float)CEL_SIDE_OFFSETS[side][1], (float)CEL_SIDE_OFFSETS[side][2] };
+                    if (Vector3DotProduct(cross, normal) <= 0.0f) side = -1;
+                }
+                paletteTriangleSides[id][m].push_back((int8_t)side);
+            }
         }
-        Mesh &shape = *pair.second;
-        DynMesh &mesh = meshMap[pair.first];
-        //Generate vertex data for this tile.
-        for (const Matrix &matrix : matrices)
+        if (!Assets::IsTextureSeeThrough(tile.texture)) paletteCoveredSides[id] = GetCoveredSides(*paletteShapes[id], TileRotationMatrix(tile), halfSize);
+        if (mergeFaces)
         {
-            int vBase = mesh.positions.size();
-            mesh.triCount += shape.triangleCount;
-            for (int v = 0; v < shape.vertexCount; v++)
+            paletteSideFaces[id].resize(paletteShapes[id]->meshCount);
+            for (int m = 0; m < paletteShapes[id]->meshCount; ++m) 
             {
-                if (shape.vertices != NULL)
+                GetSideFaces(paletteShapes[id]->meshes[m], TileRotationMatrix(tile), _spacing, paletteSideFaces[id][m].data());
+            }
+        }
+    }
+
+    auto addTile = [&](ModelPart &part, int x, int y, int z, TileID id) {
+        const Tile &tile = _palette[id];
+        const Matrix matrix = _TileTransform(Vector3Zero(), x, y, z, tile);
+
+        uint8_t hiddenSides = 0;
+        for (int s = 0; s < 6; ++s)
+        {
+            int i = x + CEL_SIDE_OFFSETS[s][0], j = y + CEL_SIDE_OFFSETS[s][1], k = z + CEL_SIDE_OFFSETS[s][2];
+            if (i < 0 || j < 0 || k < 0 || i >= (int)_width || j >= (int)_height || k >= (int)_length) continue;
+            TileID neighbor = GetCel(i, j, k);
+            if (neighbor != 0 && (paletteCoveredSides[neighbor] & (1 << (s ^ 1)))) hiddenSides |= (1 << s);
+        }
+
+        const Model &shapeModel = *paletteShapes[id];
+        for (int m = 0; m < shapeModel.meshCount; ++m)
+        {
+            const Mesh &shape = shapeModel.meshes[m];
+            DynMesh &mesh = part.GetMesh(tile.texture, (shape.indices != NULL) ? shape.vertexCount : shape.triangleCount * 3, shape.indices != NULL);
+
+            uint8_t mergedSides = 0;
+            if (mergeFaces)
+            {
+                const std::array<SideFace, 6> &faces = paletteSideFaces[id][m];
+                for (int s = 0; s < 6; ++s)
                 {
-                    //Transform shape vertices into tile's orientation and position
-                    Vector3 vec = (Vector3) { shape.vertices[v*3], shape.vertices[v*3 + 1], shape.vertices[v*3 + 2] };
-                    vec = Vector3Transform(vec, matrix);
-                    mesh.positions.push_back(vec.x);
-                    mesh.positions.push_back(vec.y);
-                    mesh.positions.push_back(vec.z);
+                    if (!faces[s].mergeable || (hiddenSides & (1 << s))) continue;
+                    mergedSides |= (1 << s);
+
+                    const Vector2 cel = GetSideCoords((Vector3) { (float)x, (float)y, (float)z }, s);
+                    const int plane = (s / 2 == 0) ? x : ((s / 2 == 1) ? y : z);
+                    const Vector2 uvFraction = { faces[s].uvCenter.x - floorf(faces[s].uvCenter.x), faces[s].uvCenter.y - floorf(faces[s].uvCenter.y) };
+                    const int uvFractionU = (int)roundf(uvFraction.x * 1024.0f) % 1024;
+                    const int uvFractionV = (int)roundf(uvFraction.y * 1024.0f) % 1024;
+                    FaceGroupKey key = std::make_tuple(tile.texture, s, plane, 
+                        faces[s].uvAxes[0][0], faces[s].uvAxes[0][1], faces[s].uvAxes[1][0], faces[s].uvAxes[1][1], 
+                        uvFractionU, uvFractionV, shape.colors != NULL);
+                    FaceGroup &group = part.faceGroups[key];
+                    if (group.cels.empty()) group.uvFraction = uvFraction;
+                    group.cels.insert(std::make_pair((int)cel.y, (int)cel.x));
                 }
+            }
+
+            //Transform the whole shape into the tile's orientation and position at once. Normals are rotated, but not moved.
+            if (shape.vertices != NULL)
+            {
+                part.shapePositions.resize(shape.vertexCount * 3);
+                Vector3TransformArray(shape.vertices, part.shapePositions.data(), shape.vertexCount, matrix, true);
+            }
+            if (shape.normals != NULL)
+            {
+                part.shapeNormals.resize(shape.vertexCount * 3);
+                Vector3TransformArray(shape.normals, part.shapeNormals.data(), shape.vertexCount, matrix, false);
+            }
 
+            //Generate vertex data for this tile, copying over a range of the shape's vertices.
+            auto addVertices = [&](int first, int count) {
+                if (shape.vertices != NULL)
+                {
+                    const float *start = part.shapePositions.data() + (first * 3);
+                    mesh.positions.insert(mesh.positions.end(), start, start + (count * 3));
+                }
                 if (shape.normals != NULL)
                 {
-                    //Transform normals by the tile's rotation, but not its position
-                    Matrix rotMatrix = matrix;
-                    rotMatrix.m12 = 0.0f;
-                    rotMatrix.m13 = 0.0f;
-                    rotMatrix.m14 = 0.0f;
-                    
-                    Vector3 norm = (Vector3) { shape.normals[v*3], shape.normals[v*3 + 1], shape.normals[v*3 + 2] };
-                    norm = Vector3Transform(norm, rotMatrix);
-                    mesh.normals.push_back(norm.x);
-                    mesh.normals.push_back(norm.y);
-                    mesh.normals.push_back(norm.z);
+                    const float *start = part.shapeNormals.data() + (first * 3);
+                    mesh.normals.insert(mesh.normals.end(), start, start + (count * 3));
                 }
-
                 if (shape.texcoords != NULL)
                 {
                     //Tex coordinates are just copied into the aggregate mesh
-                    mesh.texCoords.push_back(shape.texcoords[v*2]);
-                    mesh.texCoords.push_back(shape.texcoords[v*2 + 1]);
+                    mesh.texCoords.insert(mesh.texCoords.end(), shape.texcoords + (first * 2), shape.texcoords + ((first + count) * 2));
                 }
-
                 if (shape.colors != NULL)
                 {
-                    //Vertex colors are not supported in shapes, so just fill it with white.
-                    mesh.colors.push_back(shape.colors[v*4 + 0]);
-                    mesh.colors.push_back(shape.colors[v*4 + 1]);
-                    mesh.colors.push_back(shape.colors[v*4 + 2]);
-                    mesh.colors.push_back(shape.colors[v*4 + 3]);
+                    mesh.colors.insert(mesh.colors.end(), shape.colors + (first * 4), shape.colors + ((first + count) * 4));
                 }
-            }
+            };
+
+            //Hidden triangles are left out, and merged ones are added later
+            const uint8_t skippedSides = hiddenSides | mergedSides;
+            const std::vector<int8_t> &triangleSides = paletteTriangleSides[id][m];
+            auto isTriangleHidden = [&](int t) {
+                if (skippedSides == 0 || triangleSides.empty()) return false;
+                return triangleSides[t] >= 0 && (skippedSides & (1 << triangleSides[t]));
+            };
+
             if (shape.indices != NULL)
             {
-                for (int i = 0; i < shape.triangleCount * 3; i++)
+                //Vertices are shared, so keep all of them and only leave out the hidden triangles' indices
+                int vBase = mesh.positions.size() / 3;
+                addVertices(0, shape.vertexCount);
+                for (int t = 0; t < shape.triangleCount; t++)
+                {
+                    if (isTriangleHidden(t)) continue;
+                    for (int c = 0; c < 3; ++c)
+                    {
+                        //Add indicies, but with the offset of the current tile's vertices.
+                        mesh.indices.push_back((unsigned short)(vBase + shape.indices[(t * 3) + c]));
+                    }
+                    mesh.triCount += 1;
+                }
+            }
+            else if (skippedSides == 0)
+            {
+                addVertices(0, shape.triangleCount * 3);
+                mesh.triCount += shape.triangleCount;
+            }
+            else
+            {
+                for (int t = 0; t < shape.triangleCount; t++)
                 {
-                    //Add indicies, but with the offset of the current tile's vertices.
-                    mesh.indices.push_back((unsigned short)(vBase + shape.indices[i]));
+                    if (isTriangleHidden(t)) continue;
+                    addVertices(t * 3, 3);
+                    mesh.triCount += 1;
                 }
             }
         }
-    }
+    };
 
-    //Create Raylib mesh
-    Model *model = (Model *)RL_MALLOC(sizeof(Model));
-    model->materialCount = usedTexIDs.size();
-    model->meshCount = usedTexIDs.size();
-    model->meshMaterial = (int *)RL_CALLOC(usedTexIDs.size(), sizeof(int));
-    model->materials = (Material *)RL_CALLOC(usedTexIDs.size(), sizeof(Material));
-    model->meshes = (Mesh *)RL_CALLOC(usedTexIDs.size(), sizeof(Mesh));
-    model->transform = MatrixIdentity();
-    model->bindPose = NULL;
-    model->boneCount = 0;
-    model->bones = NULL;
-    
-    auto texID = usedTexIDs.cbegin();
-    for (int i = 0; i < model->materialCount; ++i)
-    {
-        model->materials[i] = Assets::GetMaterialForTexture(*texID, false);
-        model->meshMaterial[i] = i;
-
-        //Copy mesh data into Raylib mesh
-        DynMesh &dMesh = meshMap[*texID];
-        model->meshes[i] = (Mesh) { 0 };
-        model->meshes[i].vertexCount = dMesh.positions.size() / 3;
-        model->meshes[i].triangleCount = dMesh.triCount;
-        
-        if (dMesh.positions.size() > 0)
+    //Each chunk's tiles go into their own part, with the chunks split between the threads
+    std::vector<ModelPart> chunkParts(chunks.size());
+    runThreads(chunks.size(), 4, [&](size_t first, size_t end, size_t thread) {
+        for (size_t n = first; n < end; ++n)
         {
-            model->meshes[i].vertices = (float *) RL_CALLOC(dMesh.positions.size(), sizeof(float));
-            memcpy(model->meshes[i].vertices, dMesh.positions.data(), dMesh.positions.size() * sizeof(float));
+            const size_t c = chunks[n];
+            int i, j, k;
+            _ChunkCorner(c, i, j, k);
+            ForEachOccupied(i, j, k, GRID_CHUNK_SIZE, GRID_CHUNK_SIZE, GRID_CHUNK_SIZE, [&](int x, int y, int z, TileID id) {
+                addTile(chunkParts[n], x, y, z, id);
+            });
         }
-        if (dMesh.texCoords.size() > 0)
+    });
+
+    //Cover each group of faces with as few rectangles as possible, by extending each one as far as it can go along the rows and then down the columns.
+    auto mergeFaceGroup = [&](const FaceGroupKey &key, FaceGroup &group, ModelPart &part) {
+        const auto &[texID, side, plane, uAA, uAB, uBA, uBB, uvFractionU, uvFractionV, hasColors] = key;
+        std::set<std::pair<int, int>> &cels = group.cels;
+        while (!cels.empty())
         {
-            model->meshes[i].texcoords = (float *) RL_CALLOC(dMesh.texCoords.size(), sizeof(float));
-            memcpy(model->meshes[i].texcoords, dMesh.texCoords.data(), dMesh.texCoords.size() * sizeof(float));
+            const auto [row, col] = *cels.begin();
+            int w = 1, h = 1;
+            while (cels.find(std::make_pair(row, col + w)) != cels.end()) ++w;
+            for (bool fullRow = true; fullRow; )
+            {
+                for (int c = col; c < col + w && fullRow; ++c) fullRow = cels.find(std::make_pair(row + h, c)) != cels.end();
+                if (fullRow) ++h;
+            }
+            for (int r = row; r < row + h; ++r)
+            {
+                for (int c = col; c < col + w; ++c) cels.erase(std::make_pair(r, c));
+            }
+
+            //Place the corners of the rectangle on the side of the cels, continuing the texture mapping of the first face across it
+            const int axis = side / 2;
+            const float planePos = (plane + ((side % 2 == 0) ? 1.0f : 0.0f)) * _spacing;
+            Vector3 corners[4];
+            Vector2 uvs[4];
+            const int cornerOffsets[4][2] = { { 0, 0 }, { w, 0 }, { w, h }, { 0, h } };
+            for (int c = 0; c < 4; ++c)
+            {
+                float a = (float)(col + cornerOffsets[c][0]), b = (float)(row + cornerOffsets[c][1]);
+                corners[c] = (axis == 0) ? (Vector3) { planePos, a * _spacing, b * _spacing } :
+                             (axis == 1) ? (Vector3) { a * _spacing, planePos, b * _spacing } :
+                                           (Vector3) { a * _spacing, b * _spacing, planePos };
+                float da = cornerOffsets[c][0] - 0.5f, db = cornerOffsets[c][1] - 0.5f;
+                uvs[c] = (Vector2) { 
+                    group.uvFraction.x + (uAA * da) + (uBA * db), 
+                    group.uvFraction.y + (uAB * da) + (uBB * db) };
+            }
+
+            //Wind the triangles counter-clockwise when seen from outside of the cel
+            const Vector3 normal = { (float)CEL_SIDE_OFFSETS[side][0], (float)CEL_SIDE_OFFSETS[side][1], (float)CEL_SIDE_OFFSETS[side][2] };
+            const Vector3 cross = Vector3CrossProduct(Vector3Subtract(corners[1], corners[0]), Vector3Subtract(corners[2], corners[0]));
+            const int order[6] = { 0, 1, 2, 0, 2, 3 };
+            const bool flip = Vector3DotProduct(cross, normal) < 0.0f;
+            DynMesh &mesh = part.GetMesh(texID, 6, false);
+            for (int v = 0; v < 6; ++v)
+            {
+                const int c = flip ? order[5 - v] : order[v];
+                mesh.positions.insert(mesh.positions.end(), { corners[c].x, corners[c].y, corners[c].z });
+                mesh.normals.insert(mesh.normals.end(), { normal.x, normal.y, normal.z });
+                mesh.texCoords.insert(mesh.texCoords.end(), { uvs[c].x, uvs[c].y });
+                if (hasColors) mesh.colors.insert(mesh.colors.end(), { 255, 255, 255, 255 });
+            }
+            mesh.triCount += 2;
         }
-        if (dMesh.normals.size() > 0)
+    };
+
+    std::vector<ModelPart> faceParts;
+    if (modelPerChunk)
+    {
+        //Faces are only merged with others in the same chunk
+        runThreads(chunkParts.size(), 4, [&](size_t first, size_t end, size_t thread) {
+            for (size_t n = first; n < end; ++n)
+            {
+                for (auto &[key, group] : chunkParts[n].faceGroups) mergeFaceGroup(key, group, chunkParts[n]);
+            }
+        });
+    }
+    else
+    {
+        //Faces on the same plane can come from different chunks, so the groups are gathered together before they are split between the threads again
+        FaceGroupMap faceGroups;
+        for (ModelPart &part : chunkParts)
         {
-            model->meshes[i].normals = (float *) RL_CALLOC(dMesh.normals.size(), sizeof(float));
-            memcpy(model->meshes[i].normals, dMesh.normals.data(), dMesh.normals.size() * sizeof(float));
+            for (auto &[key, group] : part.faceGroups)
+            {
+                FaceGroup &merged = faceGroups[key];
+                if (merged.cels.empty()) merged.uvFraction = group.uvFraction;
+                merged.cels.merge(group.cels);
+            }
+            part.faceGroups.clear();
         }
-        if (dMesh.colors.size() > 0)
+        std::vector<FaceGroupMap::iterator> faceGroupList;
+        for (auto iter = faceGroups.begin(); iter != faceGroups.end(); ++iter) faceGroupList.push_back(iter);
+
+        faceParts.resize(threadCount);
+        runThreads(faceGroupList.size(), 64, [&](size_t first, size_t end, size_t thread) {
+            for (size_t g = first; g < end; ++g) mergeFaceGroup(faceGroupList[g]->first, faceGroupList[g]->second, faceParts[thread]);
+        });
+    }
+
+    //Joins the meshes of the parts together, in order, into a Raylib model, or returns nullptr if there is nothing to see in them.
+    auto createModel = [&](const std::vector<const ModelPart *> &parts) -> Model * {
+        //Decide which meshes go into each of the model's meshes.
+        //Meshes whose faces were all hidden are left out, and so are textures without any meshes left.
+        struct JoinedMesh {
+            std::vector<const DynMesh *> pieces;
+            size_t vertexCount;
+        };
+        std::map<TexID, std::vector<JoinedMesh>> joinedMeshes;
+        size_t meshCount = 0;
+        for (const ModelPart *part : parts)
         {
-            model->meshes[i].colors = (unsigned char *) RL_CALLOC(dMesh.colors.size(), sizeof(float));
-            memcpy(model->meshes[i].colors, dMesh.colors.data(), dMesh.colors.size() * sizeof(float));
+            for (const auto &[texID, pieces] : part->meshMap)
+            {
+                for (const DynMesh &piece : pieces)
+                {
+                    if (piece.triCount == 0) continue;
+                    std::vector<JoinedMesh> &texMeshes = joinedMeshes[texID];
+                    const size_t pieceVertices = piece.positions.size() / 3;
+                    if (texMeshes.empty() || texMeshes.back().vertexCount + pieceVertices > MODEL_MESH_MAX_VERTICES ||
+                        texMeshes.back().pieces[0]->indexed != piece.indexed || 
+                        texMeshes.back().pieces[0]->colors.empty() != piece.colors.empty())
+                    {
+                        texMeshes.push_back((JoinedMesh) { {}, 0 });
+                        ++meshCount;
+                    }
+                    texMeshes.back().pieces.push_back(&piece);
+                    texMeshes.back().vertexCount += pieceVertices;
+                }
+            }
         }
-        if (dMesh.indices.size() > 0)
+        if (meshCount == 0) return nullptr;
+
+        //Create Raylib mesh
+        Model *model = (Model *)RL_MALLOC(sizeof(Model));
+        model->materialCount = joinedMeshes.size();
+        model->meshCount = meshCount;
+        model->meshMaterial = (int *)RL_CALLOC(meshCount, sizeof(int));
+        model->materials = (Material *)RL_CALLOC(joinedMeshes.size(), sizeof(Material));
+        model->meshes = (Mesh *)RL_CALLOC(meshCount, sizeof(Mesh));
+        model->transform = MatrixIdentity();
+        model->bindPose = NULL;
+        model->boneCount = 0;
+        model->bones = NULL;
+
+        //Allocates an array big enough for the same attribute of every piece
+        auto allocAttribute = [](auto *&array, const JoinedMesh &joined, auto member) {
+            size_t count = 0;
+            for (const DynMesh *piece : joined.pieces) count += (piece->*member).size();
+            array = (count > 0) ? (std::remove_reference_t<decltype(array)>) RL_CALLOC(count, sizeof(*array)) : NULL;
+        };
+        
+        int i = 0, mat = 0;
+        for (const auto &[texID, texMeshes] : joinedMeshes)
         {
-            model->meshes[i].indices = (unsigned short *) RL_CALLOC(dMesh.indices.size(), sizeof(unsigned char));
-            memcpy(model->meshes[i].indices, dMesh.indices.data(), dMesh.indices.size() * sizeof(float));
+            model->materials[mat] = Assets::GetMaterialForTexture(texID, false);
+
+            //Copy mesh data into Raylib meshes
+            for (const JoinedMesh &joined : texMeshes)
+            {
+                Mesh &mesh = model->meshes[i];
+                mesh = (Mesh) { 0 };
+                mesh.vertexCount = joined.vertexCount;
+                allocAttribute(mesh.vertices, joined, &DynMesh::positions);
+                allocAttribute(mesh.texcoords, joined, &DynMesh::texCoords);
+                allocAttribute(mesh.normals, joined, &DynMesh::normals);
+                allocAttribute(mesh.colors, joined, &DynMesh::colors);
+                allocAttribute(mesh.indices, joined, &DynMesh::indices);
+
+                size_t vBase = 0, idx = 0;
+                for (const DynMesh *piece : joined.pieces)
+                {
+                    if (mesh.vertices != NULL) memcpy(mesh.vertices + (vBase * 3), piece->positions.data(), piece->positions.size() * sizeof(float));
+                    if (mesh.texcoords != NULL) memcpy(mesh.texcoords + (vBase * 2), piece->texCoords.data(), piece->texCoords.size() * sizeof(float));
+                    if (mesh.normals != NULL) memcpy(mesh.normals + (vBase * 3), piece->normals.data(), piece->normals.size() * sizeof(float));
+                    if (mesh.colors != NULL) memcpy(mesh.colors + (vBase * 4), piece->colors.data(), piece->colors.size() * sizeof(unsigned char));
+                    //Indices are offset by the vertices of the pieces before this one
+                    for (unsigned short index : piece->indices) mesh.indices[idx++] = (unsigned short)(vBase + index);
+                    vBase += piece->positions.size() / 3;
+                    mesh.triangleCount += piece->triCount;
+                }
+
+                UploadMesh(&mesh, false);
+                model->meshMaterial[i] = mat;
+                ++i;
+            }
+
+            ++mat;
         }
 
-        UploadMesh(&model->meshes[i], false);
+        return model;
+    };
+
+    std::vector<Model *> models;
+    if (modelPerChunk)
+    {
+        for (const ModelPart &part : chunkParts) models.push_back(createModel({ &part }));
+    }
+    else
+    {
+        std::vector<const ModelPart *> parts;
+        for (const ModelPart &part : chunkParts) parts.push_back(&part);
+        for (const ModelPart &part : faceParts) parts.push_back(&part);
+        models.push_back(createModel(parts));
+    }
+    return models;
+}
+
+//Frees a model made by _GenerateModels(). UnloadModel() can't be used, or it would unload the materials that are used elsewhere.
+static void UnloadTileModel(Model *model)
+{
+    for (int m = 0; m < model->meshCount; ++m) UnloadMesh(model->meshes[m]);
+    RL_FREE(model->meshes);
+    RL_FREE(model->materials);
+    RL_FREE(model->meshMaterial);
+    RL_FREE(model);
+}
+
+void TileGrid::PreviewCache::Clear()
+{
+    for (PreviewChunk &chunk : chunks)
+    {
+        if (chunk.model != nullptr) UnloadTileModel(chunk.model);
+    }
+    chunks.clear();
+    regenAll = true;
+}
+
+void TileGrid::_RegenPreview()
+{
+    if (_preview.regenAll)
+    {
+        _preview.Clear();
+        _preview.chunks.resize(_chunks.size(), (PreviewChunk) { nullptr, true });
+        _preview.regenAll = false;
+    }
 
-        texID++;
+    std::vector<size_t> dirtyChunks;
+    for (size_t c = 0; c < _preview.chunks.size(); ++c)
+    {
+        if (_preview.chunks[c].dirty) dirtyChunks.push_back(c);
     }
+    if (dirtyChunks.empty()) return;
 
-    return model;
+    std::vector<Model *> models = _GenerateModels(true, dirtyChunks, true);
+    for (size_t n = 0; n < dirtyChunks.size(); ++n)
+    {
+        PreviewChunk &chunk = _preview.chunks[dirtyChunks[n]];
+        if (chunk.model != nullptr) UnloadTileModel(chunk.model);
+        chunk.model = models[n];
+        chunk.dirty = false;
+    }
 }
 
-const Model &TileGrid::GetModel()
+const Model &TileGrid::GetModel(bool mergeFaces)
 {
-    if (_regenModel || _model == nullptr)
+    if (_regenModel || _model == nullptr || mergeFaces != _modelMergesFaces)
     {
-        if (_model != nullptr)
+        if (_model != nullptr) UnloadTileModel(_model);
+
+        std::vector<size_t> chunks(_chunks.size());
+        for (size_t c = 0; c < chunks.size(); ++c) chunks[c] = c;
+        _model = _GenerateModels(mergeFaces, chunks, false)[0];
+        if (_model == nullptr)
         {
-            //Cannot use UnloadModel() or it will unload the materials that are used elsewhere.
-            RL_FREE(_model->materials);
-            RL_FREE(_model->meshMaterial);
-            for (int m = 0; m < _model->meshCount; ++m)
-            {
-                if (_model->meshes[m].vertices != NULL) RL_FREE(_model->meshes[m].vertices);
-                if (_model->meshes[m].texcoords != NULL) RL_FREE(_model->meshes[m].texcoords);
-                if (_model->meshes[m].normals != NULL) RL_FREE(_model->meshes[m].normals);
-                if (_model->meshes[m].colors != NULL) RL_FREE(_model->meshes[m].colors);
-                if (_model->meshes[m].indices != NULL) RL_FREE(_model->meshes[m].indices);
-                if (_model->meshes[m].vboId != NULL) RL_FREE(_model->meshes[m].vboId);
-            }
-            RL_FREE(_model->meshes);
-            free(_model);
+            //An empty model is still returned when there is nothing to see
+            _model = (Model *)RL_CALLOC(1, sizeof(Model));
+            _model->transform = MatrixIdentity();
         }
-        _model = _GenerateModel();
+        _modelMergesFaces = mergeFaces;
         _regenModel = false;
     }
 
@@ -323,30 +1204,65 @@ void to_json(nlohmann::json& j, const TileGrid &grid)
     j["textures"] = usedTextures;
     j["shapes"] = usedShapes;
     j["data"] = grid.GetTileDataBase64(usedTextures, usedShapes);
+    j["dataVersion"] = TILE_DATA_VERSION_RLE;
 }
 
 void from_json(const nlohmann::json& j, TileGrid &grid)
 {
     grid = TileGrid(j.at("width"), j.at("height"), j.at("length"), TILE_SPACING_DEFAULT, Tile());
-    grid.SetTileDataBase64(j.at("data"));
+    grid.SetTileDataBase64(j.at("data"), j.value("dataVersion", TILE_DATA_VERSION_RAW));
+}
+
+std::vector<bool> TileGrid::_GetUsedPaletteEntries() const
+{
+    std::vector<bool> used(_palette.size(), false);
+    ForEachOccupied([&](int x, int y, int z, TileID id) {
+        used[id] = true;
+    });
+    return used;
 }
 
 std::set<fs::path> TileGrid::GetUsedTexturePaths() const
+{
+    return GetUsedTexturePaths(GetPalettePaths());
+}
+
+std::set<fs::path> TileGrid::GetUsedShapePaths() const
+{
+    return GetUsedShapePaths(GetPalettePaths());
+}
+
+std::set<fs::path> TileGrid::GetUsedTexturePaths(const TilePalettePaths &palettePaths) const
 {
     std::set<fs::path> paths;
-    for (const Tile &tile : _grid)
+    std::vector<bool> used = _GetUsedPaletteEntries();
+    for (size_t id = 0; id < _palette.size(); ++id)
     {
-        paths.insert(Assets::PathFromTexID(tile.texture));
+        if (used[id]) paths.insert(palettePaths.textures[id]);
     }
     return paths;
 }
 
-std::set<fs::path> TileGrid::GetUsedShapePaths() const
+std::set<fs::path> TileGrid::GetUsedShapePaths(const TilePalettePaths &palettePaths) const
 {
     std::set<fs::path> paths;
-    for (const Tile &tile : _grid)
+    std::vector<bool> used = _GetUsedPaletteEntries();
+    for (size_t id = 0; id < _palette.size(); ++id)
+    {
+        if (used[id]) paths.insert(palettePaths.shapes[id]);
+    }
+    return paths;
+}
+
+TilePalettePaths TileGrid::GetPalettePaths() const
+{
+    TilePalettePaths paths;
+    paths.textures.reserve(_palette.size());
+    paths.shapes.reserve(_palette.size());
+    for (const Tile &tile : _palette)
     {
-        paths.insert(Assets::PathFromModelID(tile.shape));
+        paths.textures.push_back(Assets::PathFromTexID(tile.texture));
+        paths.shapes.push_back(Assets::PathFromModelID(tile.shape));
     }
     return paths;
 }
@@ -30,6 +30,9 @@
 #include <assert.h>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstdint>
 
 #include "grid.hpp"
 #include "math_stuff.hpp"
@@ -37,6 +40,11 @@
 
 #define TILE_SPACING_DEFAULT 2.0f
 
+//Encodings of the tile data in .te3 files, given by the "dataVersion" key.
+#define TILE_DATA_VERSION_RAW 1 //The 16 byte binary representation of every tile. Files without a version use this.
+#define TILE_DATA_VERSION_RLE 2 //Blocks of runs of identical tiles, each compressed with DEFLATE and prefixed by its compressed size as a uint32_t.
+#define TILE_DATA_BLOCK_RUNS 65536 //The most runs that are compressed together
+
 enum class Direction { Z_POS, Z_NEG, X_POS, X_NEG, Y_POS, Y_NEG };
 
 struct Tile 
@@ -68,13 +76,59 @@ inline bool operator!=(const Tile &lhs, const Tile &rhs)
     return !(lhs == rhs);
 }
 
+struct TileHash
+{
+    inline size_t operator()(const Tile &tile) const
+    {
+        return std::hash<int>()(tile.shape) ^ (std::hash<int>()(tile.texture) << 8) 
+            ^ (std::hash<int>()(tile.angle) << 16) ^ (std::hash<int>()(tile.pitch) << 24);
+    }
+};
+
+//Index into a TileGrid's palette of unique tiles. Zero always refers to the empty tile.
+typedef uint16_t TileID;
+
+#define TILE_PALETTE_MAX 65536
+
 inline Matrix TileRotationMatrix(const Tile &tile)
 {
     return MatrixMultiply( 
         MatrixRotateX(ToRadians(tile.pitch)), MatrixRotYDeg(tile.angle));
 }
 
-class TileGrid : public Grid<Tile>
+//Per-instance data for drawing a tile with the instanced map shader, which expands it into a full transformation.
+struct TileInstance
+{
+    uint8_t x, y, z; //Cel coordinates relative to the chunk the tile is in
+    uint8_t orientation; //Quarter turns of yaw, plus four times the quarter turns of pitch
+
+    inline TileInstance(int x, int y, int z, const Tile &tile)
+        : x((uint8_t)x), y((uint8_t)y), z((uint8_t)z), 
+          orientation((uint8_t)(((tile.angle / 90) & 3) | (((tile.pitch / 90) & 3) << 2)))
+    {
+    }
+};
+
+//Counts of what the last call to TileGrid::Draw() sent to the GPU, out of everything in the visible layers.
+struct TileDrawStats
+{
+    size_t chunksTotal;
+    size_t chunksDrawn; //Chunks that were inside of the camera's frustum
+    size_t instancesTotal;
+    size_t instancesDrawn;
+};
+
+//The texture and shape paths of each entry in a tile grid's palette, indexed by TileID.
+//Saving looks paths up in this instead of in Assets, so that a copy of a grid can be saved on another thread with the paths from when it was copied.
+struct TilePalettePaths
+{
+    std::vector<fs::path> textures;
+    std::vector<fs::path> shapes;
+};
+
+//A grid of tiles. Each cel stores a TileID referring to one of the grid's unique tiles, 
+//since maps are mostly built from a small number of shape, texture, and orientation combinations.
+class TileGrid : public Grid<TileID>
 {
 public:
     //Constructs a blank TileGrid with no size
@@ -90,41 +144,33 @@ public:
 
     //Constructs a TileGrid filled with the given tile.
     inline TileGrid(size_t width, size_t height, size_t length, float spacing, Tile fill)
-        : Grid<Tile>(width, height, length, spacing, fill)
+        : Grid<TileID>(width, height, length, spacing, fill ? 1 : 0)
     {
-        _batchFromY = 0;
-        _batchToY = height - 1;
-        _batchPosition = Vector3Zero();
+        _palette.push_back(Tile());
+        _paletteLookup[Tile()] = 0;
+        if (fill)
+        {
+            _palette.push_back(fill);
+            _paletteLookup[fill] = 1;
+        }
+
         _model = nullptr;
-        _regenBatches = true;
         _regenModel = true;
+        _modelMergesFaces = false;
+        _drawStats = {};
     }
 
     inline void SetTile(int i, int j, int k, const Tile& tile) 
     {
-        SetCel(i, j, k, tile);
-        _regenBatches = true;
-        _regenModel = true;
+        SetCel(i, j, k, _PaletteIndex(tile));
+        _MarkDirty(i, j, k, 1, 1, 1);
     }
 
     //Sets a range of tiles in the grid inside of the rectangular prism with a corner at (i, j, k) and size (w, h, l).
     inline void SetTileRect(int i, int j, int k, int w, int h, int l, const Tile& tile)
     {
-        assert(i >= 0 && j >= 0 && k >= 0);
-        assert(i + w <= _width && j + h <= _height && k + l <= _length);
-        for (int y = j; y < j + h; ++y)
-        {
-            for (int z = k; z < k + l; ++z)
-            {
-                size_t base = FlatIndex(0, y, z);
-                for (int x = i; x < i + w; ++x)
-                {
-                    _grid[base + x] = tile;
-                }
-            }
-        }
-        _regenBatches = true;
-        _regenModel = true;
+        FillCels(i, j, k, w, h, l, _PaletteIndex(tile));
+        _MarkDirty(i, j, k, w, h, l);
     }
 
     //Takes the tiles of `src` and places them in this grid starting at the offset at (i, j, k)
@@ -132,40 +178,32 @@ public:
     //If `ignoreEmpty` is true, then empty tiles do not overwrite existing tiles.
     inline void CopyTiles(int i, int j, int k, const TileGrid &src, bool ignoreEmpty = false)
     {
-        assert(i >= 0 && j >= 0 && k >= 0);
-        int xEnd = Min(i + src._width, _width); 
-        int yEnd = Min(j + src._height, _height);
-        int zEnd = Min(k + src._length, _length);
-        for (int z = k; z < zEnd; ++z) 
-        {
-            for (int y = j; y < yEnd; ++y)
+        //Translate the other grid's palette into ours as its tiles are encountered.
+        //Compacting would renumber the IDs that are already translated, so make room beforehand if the palettes might not fit together.
+        if (_palette.size() + src._palette.size() > TILE_PALETTE_MAX) _CompactPalette();
+        std::vector<TileID> remapped(src._palette.size(), 0);
+        std::vector<bool> isRemapped(src._palette.size(), false);
+        auto remap = [&](TileID id) -> TileID {
+            if (!isRemapped[id])
             {
-                size_t ourBase = FlatIndex(0, y, z);
-                size_t theirBase = src.FlatIndex(0, y - j, z - k);
-                for (int x = i; x < xEnd; ++x)
-                {
-                    const Tile &tile = src._grid[theirBase + (x - i)];
-                    if (!ignoreEmpty || tile)
-                    {
-                        _grid[ourBase + x] = tile;
-                    }
-                }
+                remapped[id] = _PaletteIndex(src._palette[id], false);
+                isRemapped[id] = true;
             }
-        }
-        _regenBatches = true;
-        _regenModel = true;
+            return remapped[id];
+        };
+        CopyCels(i, j, k, src, ignoreEmpty, remap);
+        _MarkDirty(i, j, k, src._width, src._height, src._length);
     }
 
     inline Tile GetTile(int i, int j, int k) const 
     {
-        return GetCel(i, j, k);
+        return _palette[GetCel(i, j, k)];
     }
 
     inline void UnsetTile(int i, int j, int k) 
     {
-        _grid[FlatIndex(i, j, k)].shape = NO_MODEL;
-        _regenBatches = true;
-        _regenModel = true;
+        SetCel(i, j, k, 0);
+        _MarkDirty(i, j, k, 1, 1, 1);
     }
 
     //Returns a smaller TileGrid with a copy of the tile data in the rectangle defined by coordinates (i, j, k) and size (w, h, l).
@@ -175,42 +213,245 @@ public:
         assert(i + w <= _width && j + h <= _height && k + l <= _length);
 
         TileGrid newGrid(w, h, l);
+        //Sharing the palette lets the tile IDs be copied as they are.
+        newGrid._palette = _palette;
+        newGrid._paletteLookup = _paletteLookup;
 
         SubsectionCopy(i, j, k, w, h, l, newGrid);
 
-        newGrid._regenBatches = true;
-
         return newGrid;
     }
 
+    //Resizes the grid to (width, height, length) and moves the tiles by (ofsX, ofsY, ofsZ), removing those that end up outside of it.
+    inline void Resize(int ofsX, int ofsY, int ofsZ, size_t width, size_t height, size_t length)
+    {
+        Grid<TileID>::Resize(ofsX, ofsY, ofsZ, width, height, length);
+        //The chunks are numbered differently now
+        _batches.Clear();
+        _preview.Clear();
+        _regenModel = true;
+    }
+
+    //Returns the approximate number of bytes taken up by the grid's tiles.
+    inline size_t GetMemoryUsage() const
+    {
+        return Grid<TileID>::GetMemoryUsage() + _palette.capacity() * sizeof(Tile) + _paletteLookup.size() * (sizeof(Tile) + sizeof(TileID));
+    }
+
     //Draws the tile grid, hiding all layers that are outside of the given y coordinate range.
     void Draw(Vector3 position, int fromY, int toY);
     void Draw(Vector3 position);
+    //Returns the total number of bytes of instance data that drawing this grid has sent to the GPU.
+    inline size_t GetInstanceBytesUploaded() const { return _batches.bytesUploaded; }
+    inline const TileDrawStats &GetDrawStats() const { return _drawStats; }
 
-    //Returns a base64 encoded string with the binary representations of all tiles.
+    //Returns a base64 encoded string with the tiles in the TILE_DATA_VERSION_RLE encoding.
     //Requires lists of used textures and shapes generated by GetUsedTexturePaths() and its counterpart.
     std::string GetTileDataBase64(const std::set<fs::path> &usedTextures, const std::set<fs::path> &usedShapes) const;
 
-    //Assigns tiles based on the binary data encoded in base 64. Assumes that the sizes of the data and the current grid are the same.
-    void SetTileDataBase64(std::string data);
+    //Writes the same string as above into `out` a block at a time, without holding all of the data in memory at once.
+    void WriteTileDataBase64(std::ostream &out, const std::set<fs::path> &usedTextures, const std::set<fs::path> &usedShapes, const TilePalettePaths &palettePaths) const;
+
+    //Assigns tiles based on base 64 encoded data in the given encoding version. Assumes that the sizes of the data and the current grid are the same.
+    void SetTileDataBase64(std::string data, int version);
+
+    //Gets the tiles in a compact form for binary files. `palette` receives each unique tile in the grid, starting with the empty tile,
+    //with their texture and shape IDs replaced by indices into the given lists. `cels` receives the palette index of each cel in order of their flat indices.
+    void GetTileDataBinary(const std::vector<fs::path> &textures, const std::vector<fs::path> &shapes, const TilePalettePaths &palettePaths, 
+        std::vector<Tile> &palette, std::vector<TileID> &cels) const;
+
+    //Replaces all tiles with ones given in the form above, except that the palette has texture and shape IDs instead of indices.
+    //`cels` must have an entry for every cel, and each of them must index into `palette`, whose first tile must be the empty one.
+    void SetTileDataBinary(const std::vector<Tile> &palette, const TileID *cels);
 
     std::set<fs::path> GetUsedTexturePaths() const;
     std::set<fs::path> GetUsedShapePaths() const;
+    std::set<fs::path> GetUsedTexturePaths(const TilePalettePaths &palettePaths) const;
+    std::set<fs::path> GetUsedShapePaths(const TilePalettePaths &palettePaths) const;
 
-    const Model &GetModel();
+    //Looks up the paths of every palette entry's texture and shape. This uses Assets, so it must be done on the main thread.
+    TilePalettePaths GetPalettePaths() const;
+
+    //Returns a single model with the geometry of all tiles combined, leaving out faces that can't be seen.
+    //If `mergeFaces` is true, then flat faces that line up with each other are merged into larger ones.
+    const Model &GetModel(bool mergeFaces = true);
 protected:
-    //Calculates lists of transformations for each tile, separated by texture and shape, to be drawn as instances.
-    void _RegenBatches(Vector3 position, int fromY, int toY);
-    Model *_GenerateModel();
+    //Returns the palette index of the given tile, adding it to the palette if it isn't there yet.
+    //If the palette is full, unused entries are removed to make room, unless `allowCompact` is false because the caller is holding on to IDs
+    //that aren't in the grid's cels yet. Throws std::length_error if there is no room.
+    inline TileID _PaletteIndex(const Tile &tile, bool allowCompact = true)
+    {
+        if (!tile) return 0; //All empty tiles are treated the same.
 
-    std::map<std::pair<TexID, Mesh*>, std::vector<Matrix>> _drawBatches;
-    Vector3 _batchPosition;
-    bool _regenBatches;
+        auto iter = _paletteLookup.find(tile);
+        if (iter != _paletteLookup.end()) return iter->second;
+
+        if (_palette.size() >= TILE_PALETTE_MAX && allowCompact) _CompactPalette();
+        if (_palette.size() >= TILE_PALETTE_MAX) throw std::length_error("Too many unique tiles in one grid.");
+
+        TileID id = (TileID)_palette.size();
+        _palette.push_back(tile);
+        _paletteLookup[tile] = id;
+        return id;
+    }
+
+    //Removes tiles from the palette that aren't used in the grid anymore.
+    void _CompactPalette();
+    //Returns a flag for each palette entry indicating if any cel refers to it.
+    std::vector<bool> _GetUsedPaletteEntries() const;
+
+    //The instances for one texture and shape in a chunk, sorted by layer.
+    struct LayeredBatch
+    {
+        std::vector<TileInstance> instances; //Only kept until they are sent to the GPU
+        size_t layerEnds[GRID_CHUNK_SIZE]; //One past the index of the last instance in each of the chunk's layers
+        unsigned int vboId; //GPU buffer holding a copy of `instances`, or 0 if there is none yet
+        size_t vboCapacity; //Number of instances the GPU buffer has room for
+        bool uploaded; //Set when the GPU buffer matches `instances`
+    };
+
+    //The instance batches for the tiles in one chunk of the grid.
+    struct BatchChunk
+    {
+        std::map<std::pair<TexID, Mesh*>, LayeredBatch> batches;
+        bool dirty; //Set when the chunk's tiles have changed since the batches were calculated
+    };
+
+    //Instance batches are stored per chunk, so that editing tiles only requires recalculating the chunks that were touched.
+    //Within each chunk they are sorted by layer, so that hiding layers only changes which ranges of them get drawn.
+    //Instances are stored relative to their chunk, so moving the grid doesn't require recalculating them either.
+    //Each batch keeps its instances in a GPU buffer between frames, which is only updated after the batch is recalculated.
+    //The cache is derived from the tiles, so copies of a grid start with an empty cache rather than duplicating it.
+    struct BatchCache
+    {
+        std::vector<BatchChunk> chunks; //Indexed the same way as the grid's chunks
+        bool regenAll; //Set when every chunk needs recalculating
+        size_t bytesUploaded; //Total size of the instance data sent to the GPU so far
+
+        inline BatchCache() 
+            : regenAll(true), bytesUploaded(0)
+        {
+        }
+
+        inline BatchCache(const BatchCache &)
+            : BatchCache()
+        {
+        }
+
+        inline BatchCache &operator=(const BatchCache &)
+        {
+            Clear();
+            return *this;
+        }
+
+        inline ~BatchCache()
+        {
+            Clear();
+        }
+
+        //Removes all batches and frees their GPU buffers.
+        void Clear();
+    };
+
+    //The preview model of one chunk of the grid.
+    struct PreviewChunk
+    {
+        Model *model; //nullptr if the chunk has nothing to see in it
+        bool dirty; //Set when the chunk's tiles, or the tiles next to it, have changed since the model was made
+    };
+
+    //The preview is drawn with a model for each chunk, so that editing tiles only requires rebuilding the models of the chunks around them.
+    //Faces are only merged with others in the same chunk. Like the batches, copies of a grid start with an empty cache.
+    struct PreviewCache
+    {
+        std::vector<PreviewChunk> chunks; //Indexed the same way as the grid's chunks
+        bool regenAll; //Set when every chunk needs rebuilding
+
+        inline PreviewCache() 
+            : regenAll(true)
+        {
+        }
+
+        inline PreviewCache(const PreviewCache &)
+            : PreviewCache()
+        {
+        }
+
+        inline PreviewCache &operator=(const PreviewCache &)
+        {
+            Clear();
+            return *this;
+        }
+
+        inline ~PreviewCache()
+        {
+            Clear();
+        }
+
+        //Removes all models and frees their GPU buffers.
+        void Clear();
+    };
+
+    //Calls `fn(c)` with the index of each chunk overlapping the rectangular prism at (i, j, k) with size (w, h, l).
+    template<typename F>
+    inline void _ForEachChunkIn(int i, int j, int k, int w, int h, int l, F fn) const
+    {
+        int xEnd = Min(i + w, _width) - 1, yEnd = Min(j + h, _height) - 1, zEnd = Min(k + l, _length) - 1;
+        i = Max(i, 0); j = Max(j, 0); k = Max(k, 0);
+        if (i > xEnd || j > yEnd || k > zEnd) return;
+        for (int cy = (j + _originY) / GRID_CHUNK_SIZE; cy <= (yEnd + _originY) / GRID_CHUNK_SIZE; ++cy)
+        {
+            for (int cz = (k + _originZ) / GRID_CHUNK_SIZE; cz <= (zEnd + _originZ) / GRID_CHUNK_SIZE; ++cz)
+            {
+                for (int cx = (i + _originX) / GRID_CHUNK_SIZE; cx <= (xEnd + _originX) / GRID_CHUNK_SIZE; ++cx)
+                {
+                    fn(cx + (cz * _chunksX) + (cy * _chunksX * _chunksZ));
+                }
+            }
+        }
+    }
+
+    //Marks the batches and preview models of the chunks overlapping the rectangular prism at (i, j, k) with size (w, h, l) as needing recalculation.
+    inline void _MarkDirty(int i, int j, int k, int w, int h, int l)
+    {
+        _regenModel = true;
+        if (w <= 0 || h <= 0 || l <= 0) return;
+
+        if (!_batches.regenAll)
+        {
+            _ForEachChunkIn(i, j, k, w, h, l, [&](size_t c) { _batches.chunks[c].dirty = true; });
+        }
+        //Changing a tile can hide or reveal the faces of the tiles next to it, which may be in the neighboring chunks.
+        if (!_preview.regenAll)
+        {
+            _ForEachChunkIn(i - 1, j - 1, k - 1, w + 2, h + 2, l + 2, [&](size_t c) { _preview.chunks[c].dirty = true; });
+        }
+    }
+
+    //Returns the world space transformation of the tile at (i, j, k) when the grid is drawn at `position`.
+    Matrix _TileTransform(Vector3 position, int i, int j, int k, const Tile &tile) const;
+    //Recalculates the batches of the chunk at index `c`, one layer at a time.
+    void _BuildChunkBatches(size_t c, BatchChunk &out) const;
+    //Recalculates the batches of chunks that have changed.
+    void _RegenBatches();
+    //Sends the batch's instances to its GPU buffer if they have changed since the last upload.
+    void _UploadBatch(LayeredBatch &batch);
+    //Rebuilds the preview models of chunks that have changed.
+    void _RegenPreview();
+    //Makes models with the combined geometry of the tiles in the listed chunks, leaving out faces that can't be seen.
+    //If `modelPerChunk` is true, then there is a model for each chunk, or nullptr if it has nothing to see. Otherwise, there is one model, or nullptr.
+    std::vector<Model *> _GenerateModels(bool mergeFaces, const std::vector<size_t> &chunks, bool modelPerChunk);
+
+    BatchCache _batches;
+    PreviewCache _preview;
+    TileDrawStats _drawStats;
     bool _regenModel;
-    int _batchFromY;
-    int _batchToY;
+    bool _modelMergesFaces; //Whether the current model was generated with merged faces
 
     Model *_model;
+
+    std::vector<Tile> _palette; //Unique tiles referred to by the grid's cels.
+    std::unordered_map<Tile, TileID, TileHash> _paletteLookup;
 };
 
 void to_json(nlohmann::json& j, const TileGrid &grid);